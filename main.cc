@@ -1,40 +1,112 @@
 #include <cstdio>
 #include <cstdlib>
+#include <cstdint>
+#include <cstring>
 #include <cmath>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 //////////////////////////////
 // マクロ・定数
 //////////////////////////////
-#define IMAGE_HEIGHT 20
-#define IMAGE_WIDTH 20
-#define PARTS_HEIGHT 10
-#define PARTS_WIDTH 10
+#define PARTS_SIZE 10
 #define ROTATION_SIZE 4
+#define FILE_NAME_SIZE 256
 #define BASE_FILE_NAME "noguchi_parts.txt"
 #define TARGET_FILE_NAME "kitazato_parts_white.txt"
-#define RESULT_TXT "kitazato_seq.txt"
-#define RESULT_BMP "kitazato_result.bmp"
+#define RESULT_TXT "_seq.txt"
+#define RESULT_BMP "_result.bmp"
+#define COST_FILE_NAME "_cost.bin"
+#define COST_MAGIC 0x54534F43 // "COST"
+#define COST_ALIGN 64
+#define TILE_MAGIC 0x454C4954 // "TILE"
+#define TILE_ALIGN 64
+#define SOLVER_GREEDY 0
+#define SOLVER_LAP 1
+#define SOLVER_AUCTION 2
+#define SOLVER_PQ 3
+#define SOLVER_ANN 4
+#define AUCTION_SCALING 5
+#define ANNEAL_REPLICAS 4
+#define ANNEAL_STEPS 10
+#define ANNEAL_T_MAX 0.05
+#define ANNEAL_T_MIN 0.0001
+#define SWEEP_BRIGHTNESS_MIN -50
+#define SWEEP_BRIGHTNESS_MAX 50
+#define SWEEP_BRIGHTNESS_STEP 10
+#define SWEEP_TOP 3
+#define ALIGN_TOP 3
+#define SORT_PARALLEL_SIZE 1024
+#define PRUNE_CHUNK 32
+#define BENCH_LOAD 0
+#define BENCH_COORD 1
+#define BENCH_COST 2
+#define BENCH_BRIGHTNESS 3
+#define BENCH_SORT 4
+#define BENCH_TXT 5
+#define BENCH_BMP 6
+#define BENCH_STAGES 7
+#define STATS_FILE_NAME "_stats.json"
+#define STATS_THREADS 64
+#define STATS_BUCKETS 24
+// 並び替えの計測(-DMOSAIC_STATS=0 でビルドすると記録しない)
+#ifndef MOSAIC_STATS
+#define MOSAIC_STATS 1
+#endif
+#define ANN_BLOCK 4
+#define ANN_FEATURE (ANN_BLOCK * ANN_BLOCK)
+#define ANN_DIM 8
+#define ANN_PROBE 4
+#define ANN_TOP_K 16
+#define ANN_KMEANS_ITER 10
+#define ANN_TRAIN 65536
+#define COLOR_GRAY 0
+#define COLOR_RGB 1
+#define COLOR_YCBCR 2
+#define CHANNEL_SIZE 3
 
 //////////////////////////////
 // 型定義
 //////////////////////////////
-typedef struct {
-  bool locked;
-  int no;
-  uint8_t brightness[ROTATION_SIZE][PARTS_HEIGHT][PARTS_WIDTH];
-} parts_t;
+typedef uint32_t (*ssd_func_t)(uint8_t const* const a, uint8_t const* const b, int const size);
+typedef uint32_t (*lowres_func_t)(uint16_t const* const a, uint16_t const* const b, uint16_t const* const weight, int const size);
 
 typedef struct {
-  parts_t parts[IMAGE_HEIGHT][IMAGE_WIDTH];
+  int height;          // 縦のパーツ数
+  int width;           // 横のパーツ数
+  int parts_size;      // パーツの一辺の画素数
+  int size;            // パーツ数
+  int pixels;          // パーツ 1 枚の画素数
+  int rotations;       // 保持する回転数(1 なら回転 0 のみ、ROTATION_SIZE なら全回転)
+  int color;           // 色空間(COLOR_GRAY, COLOR_RGB, COLOR_YCBCR)
+  int channels;        // 色の数(グレースケールなら 1)
+  ssd_func_t ssd;      // パーツ同士の二乗誤差の関数(色毎に呼び出す)
+  int* no;             // パーツ番号 [パーツ]
+  bool* locked;        // 使用済みか [パーツ]
+  uint8_t* brightness; // 輝度 [パーツ][保持する回転][色][縦][横]
+  void* map;           // マップしたファイル(NULL ならヒープに確保)
+  size_t map_size;     // マップしたファイルの大きさ
 } image_t;
 
 typedef struct {
   int rotation;
-  parts_t const* parts;
+  int parts; // ベース画像のパーツの添字
 } position_t;
 
 typedef struct {
-  position_t position[IMAGE_HEIGHT][IMAGE_WIDTH];
+  int height;
+  int width;
+  image_t const* image;   // ベース画像
+  position_t* position;   // [縦][横]
 } mosaic_t;
 
 typedef struct {
@@ -43,9 +115,163 @@ typedef struct {
 } coord_t;
 
 typedef struct {
-  coord_t coord[IMAGE_HEIGHT * IMAGE_WIDTH];
+  int size;
+  coord_t* coord;
 } order_t;
 
+typedef struct {
+  int target_size;  // 対象パーツ数
+  int base_size;    // ベースパーツ数
+  uint32_t* value;  // 差異 [対象パーツ][ベースパーツ][回転]
+} cost_t;
+
+typedef struct {
+  int size;          // パーツ数
+  uint32_t* value;   // 回転を考慮した最小の差異 [対象パーツ][ベースパーツ]
+  uint8_t* rotation; // 差異が最小となる回転 [対象パーツ][ベースパーツ]
+} min_cost_t;
+
+typedef struct {
+  int solver;          // 並び替えの方式
+  bool gap;            // 最適解との差を表示するか
+  bool direct;         // コストを使わずに差異を直接計算するか(貪欲法のみ)
+  bool sweep;          // パラメータを一括探索するか
+  int sweep_min;       // 探索する輝度の最小値
+  int sweep_max;       // 探索する輝度の最大値
+  int sweep_step;      // 探索する輝度の刻み幅
+  int sweep_top;       // 出力する上位の件数
+  int align;           // 見積もりで絞り込む座標の数(0 なら全ての座標を探索する)
+  int refine;          // 局所探索の制限時間(ミリ秒)
+  int anneal;          // 焼きなましのラウンド数
+  int replicas;        // 焼きなましのレプリカ数
+  int seam;            // 隣接パーツの境界の差異に対する重み
+  int grid_width;      // 横のパーツ数(0 なら正方形とみなして推定)
+  int grid_height;     // 縦のパーツ数(0 なら正方形とみなして推定)
+  int parts_size;      // BMP から読み込む場合のパーツの一辺の画素数
+  int color;           // 色空間(COLOR_GRAY ならグレースケール)
+  char const* convert; // ベース画像の変換先(バイナリ形式)
+  char const* batch;   // 一括処理のマニフェストのファイル名
+  int bench;           // 処理時間を計測する繰り返し回数(0 なら計測しない)
+  char const* base_file;   // ベース画像のファイル名
+  char const* target_file; // 対象画像のファイル名
+  char const* result_txt;  // 結果(TXT)のファイル名
+  char const* result_bmp;  // 結果(BMP)のファイル名
+  char const* cost_file;   // コストのファイル名
+  char result_txt_buffer[FILE_NAME_SIZE];
+  char result_bmp_buffer[FILE_NAME_SIZE];
+  char cost_file_buffer[FILE_NAME_SIZE];
+  int argc;            // 位置引数の数
+  char const* argv[3]; // 位置引数(X軸, Y軸, 輝度)
+} option_t;
+
+typedef struct {
+  int size;     // パーツ数
+  int32_t* sum; // 画素値の総和
+  uint8_t* min; // 画素値の最小値
+  uint8_t* max; // 画素値の最大値
+} moment_t;
+
+typedef struct {
+  int size;         // パーツ数
+  int rotations;    // 保持している回転の数
+  int blocks;       // 2x2 ブロックの一辺の数
+  int stride;       // 1 パーツ分のブロック数(16 の倍数に切り上げ)
+  lowres_func_t lowres; // 2x2 ブロックの重み付き二乗誤差の関数
+  int32_t* sum;     // 画素値の総和
+  double* norm;     // 画素値の二乗和の平方根
+  uint16_t* weight; // 2x2 ブロックの重み(4 / ブロック内の画素数、端数は 0) [stride]
+  uint16_t* block;  // 2x2 ブロック毎の画素値の総和 [パーツ][回転][stride]
+} bound_t;
+
+typedef struct {
+  uint64_t candidate; // 候補数(ベースパーツ x 回転)
+  uint64_t mean;      // 総和・二乗和の下界で除いた数
+  uint64_t lowres;    // 2x2 ブロックの下界で除いた数
+  uint64_t partial;   // 差異の途中で打ち切った数
+  uint64_t full;      // 差異を最後まで計算した数
+} prune_t;
+
+typedef struct {
+  uint64_t candidate; // 走査した候補数(ベースパーツ x 回転)
+  uint64_t lookup;    // コストの参照回数
+  uint64_t diff;      // 差異の計算回数(途中で打ち切ったものを含む)
+} stats_thread_t;
+
+typedef struct {
+  prune_t prune;                        // 枝刈りの件数
+  int threads;                          // 並び替えに使用したスレッド数
+  stats_thread_t thread[STATS_THREADS]; // スレッド毎の件数
+  uint64_t locked;                      // 使用済みのため走査しなかったベースパーツ数(全ステップの合計)
+  uint64_t histogram[STATS_BUCKETS];    // ステップ毎の処理時間の分布(マイクロ秒、2 倍毎の区間)
+  int size;                             // 記録できるステップ数
+  int steps;                            // 記録したステップ数
+  int* step_target;                     // ステップ毎の対象パーツ [size]
+  uint32_t* step_value;                 // ステップ毎の最小の差異 [size]
+  double time;                          // 並び替えの処理時間(秒)
+} stats_t;
+
+typedef struct {
+  cost_t const* cost; // 対象パーツとの差異
+  uint8_t* edge;      // ベースパーツの境界の画素 [ベースパーツ][回転][上右下左][画素]
+  int weight;         // 境界の差異に対する重み
+  int height;         // 縦のパーツ数
+  int width;          // 横のパーツ数
+  int parts_size;     // パーツの一辺の画素数
+  ssd_func_t ssd;     // 境界同士の二乗誤差の関数
+} seam_t;
+
+typedef struct {
+  int* assign;          // 配置したベースパーツ [対象パーツ]
+  uint8_t* rotation;    // 回転 [対象パーツ]
+  int64_t energy;       // 評価値
+  uint64_t seed;        // 乱数の状態
+  int* best_assign;     // 最良の配置
+  uint8_t* best_rotation;
+  int64_t best_energy;
+} replica_t;
+
+typedef struct {
+  int dx;           // X軸方向に動かすピクセル数
+  int dy;           // Y軸方向に動かすピクセル数
+  int brightness;   // 輝度を増加させる値
+  uint64_t value;   // 差異の総和
+  mosaic_t* mosaic; // 並び替えたモザイク
+} sweep_t;
+
+typedef struct {
+  int dx;          // X軸方向に動かすピクセル数
+  int dy;          // Y軸方向に動かすピクセル数
+  double residual; // 代理画像との平均輝度の二乗誤差(1 パーツあたり、画素数倍したもの)
+  int brightness;  // 輝度の補正値(ベース画像との平均の差)
+} align_t;
+
+typedef struct {
+  uint32_t value; // 回転を考慮した最小の差異
+  int target;     // 対象パーツ
+  int base;       // ベースパーツ
+} pair_t;
+
+typedef struct {
+  uint32_t magic;       // 識別子
+  int32_t target_size;  // 対象パーツ数
+  int32_t base_size;    // ベースパーツ数
+  int32_t rotation;     // 回転数
+  uint64_t base_hash;   // ベース画像のハッシュ値
+  uint64_t target_hash; // 対象画像のハッシュ値
+} cost_header_t;
+
+typedef struct {
+  uint32_t magic;             // 識別子
+  int32_t height;             // 縦のパーツ数
+  int32_t width;              // 横のパーツ数
+  int32_t parts_size;         // パーツの一辺の画素数
+  int32_t rotation;           // 回転数
+  uint32_t no_offset;         // ファイル先頭からパーツ番号までのオフセット
+  uint64_t brightness_offset; // ファイル先頭から輝度までのオフセット(64 バイト境界)
+  int32_t color;              // 色空間(no_offset がこのフィールドより前の古い形式はグレースケール)
+  int32_t reserved;           // 予約領域
+} tile_header_t;
+
 #pragma pack(2)
 typedef struct {
   uint16_t type;            // ファイルタイプ
@@ -74,71 +300,335 @@ typedef struct {
   uint8_t reserved;
 } bmp_color_t;
 
+typedef struct {
+  int height;      // 縦の画素数
+  int width;       // 横の画素数
+  int channels;    // 色の数(1 ならグレースケール、3 なら RGB)
+  uint8_t* pixel;  // 画素値(上の行から) [channels][height][width]
+} raster_t;
+
+typedef struct {
+  int size;          // 画素数(0 なら任意)
+  ssd_func_t scalar;
+#if defined(__x86_64__) || defined(__i386__)
+  ssd_func_t sse2;
+  ssd_func_t avx2;
+#endif
+} ssd_kernel_t;
+
+typedef struct {
+  int size;          // パーツ数
+  int list_count;    // リスト(クラスタ)数
+  float* mean;       // 特徴量の平均 [ANN_FEATURE]
+  float* basis;      // 主成分 [ANN_DIM][ANN_FEATURE]
+  float* feature;    // 射影した特徴量 [size][ANN_DIM]
+  float* centroid;   // クラスタの中心 [list_count][ANN_DIM]
+  int* list;         // クラスタ毎のパーツ番号 [size](各リストの先頭 list_size 個が有効)
+  int* list_begin;   // リストの開始位置 [list_count + 1]
+  int* list_size;    // リストの有効な要素数 [list_count]
+  int* slot;         // パーツの list 内の位置 [size]
+  int* cluster;      // パーツのクラスタ番号 [size]
+} index_t;
+
+typedef struct {
+  bound_t* bound;   // ベース画像の枝刈り用の下界(直接計算する場合)
+  index_t* index;   // ベース画像の近傍探索の索引(近傍探索の場合)
+} share_t;
+
+typedef struct {
+  char target_file[FILE_NAME_SIZE]; // 対象画像のファイル名
+  int argc;                         // 位置引数の数
+  int dx;                           // X軸方向に動かすピクセル数
+  int dy;                           // Y軸方向に動かすピクセル数
+  int brightness;                   // 輝度を増加させる値
+  char result_txt[FILE_NAME_SIZE];  // 結果(TXT)のファイル名
+  char result_bmp[FILE_NAME_SIZE];  // 結果(BMP)のファイル名
+  char cost_file[FILE_NAME_SIZE];   // コストのファイル名
+  int result;                       // 処理結果(0: 成功, -1: 失敗)
+  uint64_t value;                   // 差異の総和
+  double time;                      // 処理時間(秒)
+} job_t;
+
+typedef int (*assign_func_t)(min_cost_t const* const min_cost, int* const assign);
+
+char const* const SOLVER_NAME[] = { "greedy", "lap", "auction", "pq", "ann" };
+char const* const COLOR_NAME[] = { "gray", "rgb", "ycbcr" };
+// 色空間毎の色の数、輝度を変える色の数(先頭から)、二乗誤差に掛ける色毎の重み
+int const COLOR_CHANNELS[] = { 1, CHANNEL_SIZE, CHANNEL_SIZE };
+int const COLOR_LIT[] = { 1, CHANNEL_SIZE, 1 };
+uint32_t const COLOR_WEIGHT[][CHANNEL_SIZE] = { { 1, 0, 0 }, { 2, 4, 3 }, { 2, 1, 1 } };
+char const* const BENCH_STAGE_NAME[] = { "load", "add_coord", "cost", "add_brightness", "sort", "export_txt", "export_bmp" };
+
 //////////////////////////////
 // プロトタイプ宣言
 //////////////////////////////
-double diff(parts_t const* const pa, position_t const* const pb);
-double diff(position_t const* const pa, position_t const* const pb);
-order_t* create_order_by_asc();
-order_t* create_order_by_desc();
-order_t* create_order_by_center();
+template <int SIZE> uint32_t ssd_scalar(uint8_t const* const a, uint8_t const* const b, int const size);
+#if defined(__x86_64__) || defined(__i386__)
+template <int SIZE> __attribute__((target("sse2"))) uint32_t ssd_sse2(uint8_t const* const a, uint8_t const* const b, int const size);
+template <int SIZE> __attribute__((target("avx2"))) uint32_t ssd_avx2(uint8_t const* const a, uint8_t const* const b, int const size);
+#endif
+ssd_func_t select_ssd(int const size);
+uint32_t lowres_scalar(uint16_t const* const a, uint16_t const* const b, uint16_t const* const weight, int const size);
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2"))) uint32_t lowres_sse2(uint16_t const* const a, uint16_t const* const b, uint16_t const* const weight, int const size);
+__attribute__((target("avx2"))) uint32_t lowres_avx2(uint16_t const* const a, uint16_t const* const b, uint16_t const* const weight, int const size);
+#endif
+lowres_func_t select_lowres();
+uint8_t* get_brightness(image_t const* const image, int const parts, int const rotation);
+void rotate_brightness(uint8_t* const dst, uint8_t const* const src, int const parts_size, int const rotation);
+uint8_t const* get_rotated_brightness(image_t const* const image, int const parts, int const rotation, uint8_t* const buffer);
+uint32_t diff(image_t const* const target_image, int const target, image_t const* const base_image, position_t const* const position);
+order_t* alloc_order(int const size);
+order_t* create_order_by_asc(int const width, int const height);
+order_t* create_order_by_desc(int const width, int const height);
+order_t* create_order_by_center(int const width, int const height);
+void free_order(order_t* const order);
 void add_coord(image_t* const image, int dx, int dy);
 void add_brightness(image_t* const image, int value);
-void sort_mosaic(order_t const* const order, image_t* const base_image, image_t* const target_image, mosaic_t* const mosaic);
+uint64_t hash_image(image_t const* const image);
+cost_t* alloc_cost(int const target_size, int const base_size);
+cost_t* create_cost_by_image(image_t const* const base_image, image_t const* const target_image);
+cost_t* create_cost_by_file(char const* const file_name, image_t const* const base_image, image_t const* const target_image);
+int export_cost_to_file(char const* const file_name, cost_t const* const cost, image_t const* const base_image, image_t const* const target_image);
+void free_cost(cost_t* const cost);
+moment_t* create_moment_by_image(image_t const* const image);
+void free_moment(moment_t* const moment);
+int update_cost_by_brightness(cost_t* const dst, cost_t const* const src, moment_t const* const base_moment, moment_t const* const target_moment, image_t const* const base_image, image_t const* const target_image, int const brightness);
+min_cost_t* create_min_cost_by_cost(cost_t const* const cost);
+void free_min_cost(min_cost_t* const min_cost);
+bound_t* create_bound_by_image(image_t const* const image);
+void free_bound(bound_t* const bound);
+uint32_t bound_mean(bound_t const* const target_bound, int const target, bound_t const* const base_bound, int const base, int const pixels);
+uint32_t bound_lowres(bound_t const* const target_bound, int const target, bound_t const* const base_bound, int const base, int const rotation);
+uint32_t diff_partial(image_t const* const target_image, int const target, image_t const* const base_image, position_t const* const position, ssd_func_t const ssd, ssd_func_t const rest, uint32_t const limit);
+int sort_mosaic(order_t const* const order, cost_t const* const cost, bound_t const* const shared_bound, image_t* const base_image, image_t* const target_image, mosaic_t* const mosaic, stats_t* const stats);
+int solve_lap(min_cost_t const* const min_cost, int* const assign);
+int solve_auction(min_cost_t const* const min_cost, int* const assign);
+int compare_pair(void const* const a, void const* const b);
+int solve_pq(min_cost_t const* const min_cost, int* const assign);
+int sort_mosaic_by_assign(assign_func_t const solve, cost_t const* const cost, image_t* const base_image, image_t* const target_image, mosaic_t* const mosaic);
+int evaluate_lap(cost_t const* const cost, uint64_t* const value);
+double get_time();
+int refine_mosaic(cost_t const* const cost, mosaic_t* const mosaic, int const time_limit);
+seam_t* create_seam_by_image(cost_t const* const cost, image_t const* const base_image, int const weight);
+void free_seam(seam_t* const seam);
+int64_t seam_energy(seam_t const* const seam, int const* const assign, uint8_t const* const rotation, int const i, int const skip);
+int64_t total_energy(seam_t const* const seam, int const* const assign, uint8_t const* const rotation);
+uint64_t next_random(uint64_t* const seed);
+void anneal_replica(seam_t const* const seam, replica_t* const replica, double const temperature, int const steps);
+int anneal_mosaic(cost_t const* const cost, image_t const* const base_image, mosaic_t* const mosaic, int const rounds, int const replicas, int const weight, int64_t* const before, int64_t* const after);
+void create_feature(uint8_t const* const data, int const parts_size, float* const feature);
+void project_feature(index_t const* const index, float const* const feature, float* const dst);
+float distance_feature(float const* const a, float const* const b);
+void solve_eigen(double* const a, double* const v, int const n);
+index_t* create_index_by_image(image_t const* const image);
+void remove_index(index_t* const index, int const parts);
+int search_index(index_t const* const index, float const* const query, int* const candidate);
+index_t* clone_index(index_t const* const index);
+void free_index(index_t* const index);
+int sort_mosaic_by_index(order_t const* const order, index_t const* const shared_index, image_t* const base_image, image_t* const target_image, mosaic_t* const mosaic, stats_t* const stats);
+job_t* create_job_by_file(char const* const file_name, int* const size);
+int solve_job(option_t const* const option, share_t const* const share, image_t const* const base_image, job_t* const job);
+int batch_mosaic(option_t const* const option, image_t const* const base_image);
+int compare_time(void const* const a, void const* const b);
+int bench_job(option_t const* const option, job_t const* const job, int const iterations, double* const time, uint64_t* const eval, int* const tiles);
+int bench_mosaic(option_t const* const option);
+stats_t* alloc_stats(int const size);
+void free_stats(stats_t* const stats);
+void record_step(stats_t* const stats, int const target, uint32_t const value, double const time);
+int export_stats_to_json(char const* const file_name, stats_t const* const stats, char const* const solver, mosaic_t const* const mosaic, image_t const* const target_image);
+int solve_mosaic(int const solver, order_t const* const order, cost_t const* const cost, share_t const* const share, image_t* const base_image, image_t* const target_image, mosaic_t* const mosaic, stats_t* const stats);
+int compare_align(void const* const a, void const* const b);
+int64_t sum_rect(int64_t const* const sum, size_t const stride, int const x0, int const y0, int const x1, int const y1);
+int align_mosaic(image_t const* const base_image, image_t const* const target_image, align_t* const align);
+int evaluate_sweep(int const solver, order_t const* const order, image_t const* const base_image, moment_t const* const base_moment, image_t const* const target_image, sweep_t* const sweep, int const count);
+int compare_sweep(void const* const a, void const* const b);
+int sweep_mosaic(option_t const* const option, image_t const* const base_image, image_t const* const target_image);
+void create_file_name(char* const dst, size_t const size, char const* const file_name, char const* const suffix);
+void create_result_name(char* const dst, size_t const size, char const* const target_file, char const* const suffix);
+uint64_t evaluate_mosaic(mosaic_t const* const mosaic, image_t const* const target_image);
+uint64_t evaluate_mosaic_by_cost(mosaic_t const* const mosaic, cost_t const* const cost);
+int parse_option(int const argc, char* const argv[], option_t* const option);
 bool check_image(image_t const* const image);
 bool check_mosaic(mosaic_t const* const mosaic);
-image_t* create_image_by_txt(char const* const file_name);
-image_t* create_image_by_bmp(char const* const file_name);
+image_t* alloc_image(int const height, int const width, int const parts_size, int const rotations, int const color);
+void copy_image(image_t* const dst, image_t const* const src);
+image_t* clone_image(image_t const* const image);
+void free_image(image_t* const image);
+void rotate_parts(image_t* const image, int const parts);
+bool scan_int(char const** const cursor, char const* const end, int* const value);
+image_t* create_image_by_txt(char const* const file_name, int const width, int const height, int const rotations);
+raster_t* alloc_raster(int const height, int const width, int const channels);
+void free_raster(raster_t* const raster);
+uint8_t convert_gray(int const red, int const green, int const blue);
+uint8_t clamp_color(int const value);
+void encode_color(int const color, int const red, int const green, int const blue, uint8_t* const dst, size_t const plane);
+void decode_color(int const color, uint8_t const* const src, size_t const plane, int* const rgb);
+raster_t* create_raster_by_bmp(char const* const file_name, int const channels);
+bool scan_pgm_int(char const** const cursor, char const* const end, int* const value);
+raster_t* create_raster_by_pgm(char const* const file_name, int const channels);
+image_t* create_image_by_raster(raster_t const* const raster, int const width, int const height, int const parts_size, int const rotations, int const color);
+image_t* create_image_by_bmp(char const* const file_name, int const width, int const height, int const parts_size, int const rotations, int const color);
+image_t* create_image_by_pgm(char const* const file_name, int const width, int const height, int const parts_size, int const rotations, int const color);
+image_t* convert_image(image_t const* const image, int const color);
+image_t* create_image_by_bin(char const* const file_name, int const rotations);
+image_t* create_image_by_file(char const* const file_name, int const width, int const height, int const parts_size, int const rotations, int const color);
 mosaic_t* create_mosaic_by_image(image_t const* const image);
 mosaic_t* create_mosaic_by_txt(char const* const file_name, image_t const* const image);
+void free_mosaic(mosaic_t* const mosaic);
 int export_mosaic_to_txt(char const* const file_name, mosaic_t const* const mosaic);
+int write_bmp_header(FILE* const fp, int const width, int const height, int const channels);
+int write_bmp_band(FILE* const fp, image_t const* const image, position_t const* const position, int const height, int const width);
 int export_mosaic_to_bmp(char const* const file_name, mosaic_t const* const mosaic);
 int export_image_to_txt(char const* const file_name, image_t const* const image);
 int export_image_to_bmp(char const* const file_name, image_t const* const image);
+int export_image_to_bin(char const* const file_name, image_t const* const image);
 
 //////////////////////////////
 // エントリーポイント
 //////////////////////////////
 int main(int const argc, char* const argv[]) {
+  // オプションの解析
+  option_t option;
+  if (parse_option(argc, argv, &option) < 0) {
+    printf("usage: %s [dx dy [brightness]] [--base=file] [--target=file] [--grid=WxH] [--seq=file] [--bmp=file]\n", argv[0]);
+    printf("       [--solver=greedy|lap|auction|pq|ann] [--direct] [--refine=ms] [--anneal=rounds [--replicas=n] [--seam=w]] [--gap]\n");
+    printf("       [--sweep [--sweep-brightness=min:max:step] [--sweep-top=n]] [--align[=n]] [--parts=n] [--color=gray|rgb|ycbcr] [--convert=file]\n");
+    printf("       [--batch=manifest] [--bench=iterations]\n");
+    return -1;
+  }
+
+  // 各段階の処理時間を計測して終了(結果は JSON で出力する)
+  if (option.bench > 0) {
+    return bench_mosaic(&option);
+  }
+
   // ベースとなる画像オブジェクトの生成
-  printf("create image [%s] ... ", BASE_FILE_NAME);
-  image_t* base_image = create_image_by_txt(BASE_FILE_NAME);
+  // 回転は対象画像の側で持つため、ベース画像は回転 0 のみを保持する
+  printf("create image [%s] ... ", option.base_file);
+  image_t* base_image = create_image_by_file(option.base_file, option.grid_width, option.grid_height, option.parts_size, 1, option.color);
   if (base_image == NULL) {
     printf("error\n");
     return -1;
   }
-  printf("ok\n");
+  printf("ok (%dx%d, parts %d)\n", base_image->width, base_image->height, base_image->parts_size);
+
+  // バイナリ形式に変換して終了
+  if (option.convert != NULL) {
+    printf("export bin [%s] ... ", option.convert);
+    int const result = export_image_to_bin(option.convert, base_image);
+    free_image(base_image);
+    printf(result < 0 ? "error\n" : "ok\n");
+    return result;
+  }
+
+  // マニフェストの対象画像を一括で並び替えて終了
+  if (option.batch != NULL) {
+    int const result = batch_mosaic(&option, base_image);
+    free_image(base_image);
+    return result;
+  }
 
   // 対象となる画像オブジェクトの生成
-  printf("create image [%s] ... ", TARGET_FILE_NAME);
-  image_t* target_image = create_image_by_txt(TARGET_FILE_NAME);
+  // パーツ数の指定がなければベース画像に合わせる(BMP・PGM は拡大縮小して分割する)
+  printf("create image [%s] ... ", option.target_file);
+  image_t* target_image = create_image_by_file(option.target_file,
+                                               option.grid_width > 0 ? option.grid_width : base_image->width,
+                                               option.grid_height > 0 ? option.grid_height : base_image->height,
+                                               option.parts_size, ROTATION_SIZE, option.color);
   if (target_image == NULL) {
-    free(base_image);
+    free_image(base_image);
     printf("error\n");
     return -1;
   }
-  printf("ok\n");
+  printf("ok (%dx%d, parts %d)\n", target_image->width, target_image->height, target_image->parts_size);
+
+  // ベース画像のパーツを 1 つずつ当てはめるため、大きさが一致している必要がある
+  if (base_image->width != target_image->width || base_image->height != target_image->height ||
+      base_image->parts_size != target_image->parts_size) {
+    free_image(target_image);
+    free_image(base_image);
+    printf("size mismatch\n");
+    return -1;
+  }
+
+  // パラメータの一括探索(位置合わせの見積もりで絞り込んだ座標のみの探索を含む)
+  if (option.sweep || option.align > 0) {
+    int const result = sweep_mosaic(&option, base_image, target_image);
+    free_image(target_image);
+    free_image(base_image);
+    return result;
+  }
 
   // 座標を動かす
-  if (argc > 1) {
-    printf("add coord [x:%s, y:%s] ... ", argv[1], argv[2]);
-    add_coord(target_image, atoi(argv[1]), atoi(argv[2]));
+  if (option.argc > 1) {
+    printf("add coord [x:%s, y:%s] ... ", option.argv[0], option.argv[1]);
+    add_coord(target_image, atoi(option.argv[0]), atoi(option.argv[1]));
     printf("ok\n");
   }
 
+  // コストの読み込み(同じ組み合わせの計算結果があれば再利用する)
+  // 近傍探索と直接計算はコストを使わないため、読み込みも計算もしない
+  cost_t* cost = NULL;
+  if (option.solver != SOLVER_ANN && !option.direct) {
+    printf("load cost [%s] ... ", option.cost_file);
+    cost = create_cost_by_file(option.cost_file, base_image, target_image);
+    if (cost != NULL) {
+      printf("ok\n");
+    } else {
+      printf("not found\n");
+
+      // コストの計算
+      printf("create cost ... ");
+      cost = create_cost_by_image(base_image, target_image);
+      if (cost == NULL) {
+        free_image(target_image);
+        free_image(base_image);
+        printf("error\n");
+        return -1;
+      }
+      printf("ok\n");
+
+      // コストの保存(失敗しても処理は継続する)
+      printf("export cost [%s] ... ", option.cost_file);
+      if (export_cost_to_file(option.cost_file, cost, base_image, target_image) < 0) {
+        printf("error\n");
+      } else {
+        printf("ok\n");
+      }
+    }
+  }
+
   // 輝度を増加させる
-  if (argc > 3) {
-    printf("add brightness [%s] ... ", argv[3]);
-    add_brightness(target_image, atoi(argv[3]));
-    printf("ok\n");
+  // コストは輝度を変える前の値から差分で更新するため、同じ座標なら保存したコストを再利用できる
+  if (option.argc > 2) {
+    int const brightness = atoi(option.argv[2]);
+    printf("add brightness [%s] ... ", option.argv[2]);
+    moment_t* base_moment = create_moment_by_image(base_image);
+    moment_t* target_moment = create_moment_by_image(target_image);
+    if (base_moment == NULL || target_moment == NULL) {
+      free_moment(target_moment);
+      free_moment(base_moment);
+      free_cost(cost);
+      free_image(target_image);
+      free_image(base_image);
+      printf("error\n");
+      return -1;
+    }
+    add_brightness(target_image, brightness);
+    int const clamped = (cost != NULL) ? update_cost_by_brightness(cost, cost, base_moment, target_moment, base_image, target_image, brightness) : 0;
+    free_moment(target_moment);
+    free_moment(base_moment);
+    printf("ok (clamped %d)\n", clamped);
   }
-  
+
   // モザイクオブジェクトの生成
   printf("create mosaic ... ");
   mosaic_t* mosaic = create_mosaic_by_image(base_image);
   if (mosaic == NULL) {
-    free(target_image);
-    free(base_image);
+    free_cost(cost);
+    free_image(target_image);
+    free_image(base_image);
     printf("error\n");
     return -1;
   }
@@ -146,30 +636,87 @@ int main(int const argc, char* const argv[]) {
 
   // 探索順リストの生成
   printf("create order ... ");
-  // order_t* order = create_order_by_asc();
-  // order_t* order = create_order_by_desc();
-  order_t* order = create_order_by_center();
+  // order_t* order = create_order_by_asc(target_image->width, target_image->height);
+  // order_t* order = create_order_by_desc(target_image->width, target_image->height);
+  order_t* order = create_order_by_center(target_image->width, target_image->height);
   if (order == NULL) {
-    free(mosaic);
-    free(target_image);
-    free(base_image);
+    free_mosaic(mosaic);
+    free_cost(cost);
+    free_image(target_image);
+    free_image(base_image);
     printf("error\n");
     return -1;
   }
   printf("ok\n");
 
   // モザイクの並び替え
-  printf("sort mosaic ... ");
-  sort_mosaic(order, base_image, target_image, mosaic);
-  printf("ok\n");
+  printf("sort mosaic [%s] ... ", SOLVER_NAME[option.solver]);
+  stats_t* stats = alloc_stats(target_image->size);
+  if (stats == NULL || solve_mosaic(option.solver, order, cost, NULL, base_image, target_image, mosaic, stats) < 0) {
+    free_stats(stats);
+    free_order(order);
+    free_mosaic(mosaic);
+    free_cost(cost);
+    free_image(target_image);
+    free_image(base_image);
+    printf("error\n");
+    return -1;
+  }
+  prune_t const* const prune = &stats->prune;
+  if (prune->candidate > 0) {
+    // 枝刈りの各段階で除いた候補の数
+    printf("ok (candidates %llu, mean %llu, lowres %llu, partial %llu, full %llu)\n",
+           (unsigned long long)prune->candidate, (unsigned long long)prune->mean, (unsigned long long)prune->lowres,
+           (unsigned long long)prune->partial, (unsigned long long)prune->full);
+  } else {
+    printf("ok\n");
+  }
+
+  // 局所探索でモザイクを改善
+  if (option.refine > 0) {
+    printf("refine mosaic [%d ms] ... ", option.refine);
+    int const moves = refine_mosaic(cost, mosaic, option.refine);
+    if (moves < 0) {
+      free_stats(stats);
+      free_order(order);
+      free_mosaic(mosaic);
+      free_cost(cost);
+      free_image(target_image);
+      free_image(base_image);
+      printf("error\n");
+      return -1;
+    }
+    printf("ok (moves %d)\n", moves);
+  }
+
+  // 境界の連続性も考慮した焼きなまし(レプリカ交換法)
+  if (option.anneal > 0) {
+    printf("anneal mosaic [rounds:%d, replicas:%d, seam:%d] ... ", option.anneal, option.replicas, option.seam);
+    fflush(stdout);
+    int64_t before = 0;
+    int64_t after = 0;
+    if (anneal_mosaic(cost, base_image, mosaic, option.anneal, option.replicas, option.seam, &before, &after) < 0) {
+      free_stats(stats);
+      free_order(order);
+      free_mosaic(mosaic);
+      free_cost(cost);
+      free_image(target_image);
+      free_image(base_image);
+      printf("error\n");
+      return -1;
+    }
+    printf("ok (energy %lld -> %lld)\n", (long long)before, (long long)after);
+  }
 
   // 画像オブジェクトが全て使用されたかチェック
   printf("check image ... ");
   if (!check_image(base_image) || !check_image(target_image)) {
-    free(order);
-    free(mosaic);
-    free(target_image);
-    free(base_image);
+    free_stats(stats);
+    free_order(order);
+    free_mosaic(mosaic);
+    free_cost(cost);
+    free_image(target_image);
+    free_image(base_image);
     printf("error\n");
     return -1;
   }
@@ -178,84 +725,501 @@ int main(int const argc, char* const argv[]) {
   // モザイクに全てのパーツが使用されているかチェック
   printf("check mosaic ... ");
   if (!check_mosaic(mosaic)) {
-    free(order);
-    free(mosaic);
-    free(target_image);
-    free(base_image);
+    free_stats(stats);
+    free_order(order);
+    free_mosaic(mosaic);
+    free_cost(cost);
+    free_image(target_image);
+    free_image(base_image);
     printf("error\n");
     return -1;
   }
   printf("ok\n");
 
+  // 差異の総和を表示
+  uint64_t const value = evaluate_mosaic(mosaic, target_image);
+  printf("evaluate mosaic ... %llu\n", (unsigned long long)value);
+
+  // 最適解との差を表示
+  if (option.gap) {
+    printf("evaluate lap ... ");
+    uint64_t optimum = 0;
+    if (evaluate_lap(cost, &optimum) < 0) {
+      free_stats(stats);
+      free_order(order);
+      free_mosaic(mosaic);
+      free_cost(cost);
+      free_image(target_image);
+      free_image(base_image);
+      printf("error\n");
+      return -1;
+    }
+    printf("%llu (gap %.4f%%)\n", (unsigned long long)optimum, optimum > 0 ? 100.0 * (value - optimum) / optimum : 0.0);
+  }
+
   // TXTにエクスポート
-  printf("export txt [%s] ... ", RESULT_TXT);
-  if(export_mosaic_to_txt(RESULT_TXT, mosaic) < 0) {
-    free(order);
-    free(mosaic);
-    free(target_image);
-    free(base_image);
+  printf("export txt [%s] ... ", option.result_txt);
+  if(export_mosaic_to_txt(option.result_txt, mosaic) < 0) {
+    free_stats(stats);
+    free_order(order);
+    free_mosaic(mosaic);
+    free_cost(cost);
+    free_image(target_image);
+    free_image(base_image);
     printf("error\n");
     return -1;
   }
   printf("ok\n");
 
   // BMPにエクスポート
-  printf("export bmp [%s] ... ", RESULT_BMP);
-  if(export_mosaic_to_bmp(RESULT_BMP, mosaic) < 0) {
-    free(order);
-    free(mosaic);
-    free(target_image);
-    free(base_image);
+  printf("export bmp [%s] ... ", option.result_bmp);
+  if(export_mosaic_to_bmp(option.result_bmp, mosaic) < 0) {
+    free_stats(stats);
+    free_order(order);
+    free_mosaic(mosaic);
+    free_cost(cost);
+    free_image(target_image);
+    free_image(base_image);
     printf("error\n");
     return -1;
   }
   printf("ok\n");
 
+#if MOSAIC_STATS
+  // 計測結果を JSON にエクスポート(失敗しても処理は継続する)
+  char stats_file[FILE_NAME_SIZE];
+  create_result_name(stats_file, FILE_NAME_SIZE, option.result_txt, STATS_FILE_NAME);
+  printf("export stats [%s] ... ", stats_file);
+  if (export_stats_to_json(stats_file, stats, SOLVER_NAME[option.solver], mosaic, target_image) < 0) {
+    printf("error\n");
+  } else {
+    printf("ok\n");
+  }
+#endif
+
   // メモリ開放
-  free(order);
-  free(mosaic);
-  free(target_image);
-  free(base_image);
+  free_stats(stats);
+  free_order(order);
+  free_mosaic(mosaic);
+  free_cost(cost);
+  free_image(target_image);
+  free_image(base_image);
   return 0;
 }
 
 //////////////////////////////
-// 2 つのパーツの差異を数値化
+// オプションの解析
 //////////////////////////////
-double diff(parts_t const* const pa, position_t const* const pb) {
-  position_t position;
-  position.rotation = 0;
-  position.parts = pa;
-  return diff(&position, pb);
+int parse_option(int const argc, char* const argv[], option_t* const option) {
+  option->solver = SOLVER_GREEDY;
+  option->gap = false;
+  option->direct = false;
+  option->sweep = false;
+  option->sweep_min = SWEEP_BRIGHTNESS_MIN;
+  option->sweep_max = SWEEP_BRIGHTNESS_MAX;
+  option->sweep_step = SWEEP_BRIGHTNESS_STEP;
+  option->sweep_top = SWEEP_TOP;
+  option->align = 0;
+  option->refine = 0;
+  option->anneal = 0;
+  option->replicas = ANNEAL_REPLICAS;
+  option->seam = 1;
+  option->grid_width = 0;
+  option->grid_height = 0;
+  option->parts_size = PARTS_SIZE;
+  option->color = COLOR_GRAY;
+  option->convert = NULL;
+  option->batch = NULL;
+  option->bench = 0;
+  option->base_file = BASE_FILE_NAME;
+  option->target_file = TARGET_FILE_NAME;
+  option->result_txt = NULL;
+  option->result_bmp = NULL;
+  option->cost_file = NULL;
+  option->argc = 0;
+  for (int i = 1; i < argc; ++ i) {
+    char const* const arg = argv[i];
+    if (strncmp(arg, "--", 2) != 0) {
+      // 位置引数(X軸, Y軸, 輝度)
+      if (option->argc >= 3) return -1;
+      option->argv[option->argc ++] = arg;
+    } else if (strcmp(arg, "--solver=greedy") == 0) {
+      option->solver = SOLVER_GREEDY;
+    } else if (strcmp(arg, "--solver=lap") == 0) {
+      option->solver = SOLVER_LAP;
+    } else if (strcmp(arg, "--solver=auction") == 0) {
+      option->solver = SOLVER_AUCTION;
+    } else if (strcmp(arg, "--solver=pq") == 0) {
+      option->solver = SOLVER_PQ;
+    } else if (strcmp(arg, "--solver=ann") == 0) {
+      option->solver = SOLVER_ANN;
+    } else if (strcmp(arg, "--gap") == 0) {
+      option->gap = true;
+    } else if (strcmp(arg, "--direct") == 0) {
+      option->direct = true;
+    } else if (strcmp(arg, "--sweep") == 0) {
+      option->sweep = true;
+    } else if (strncmp(arg, "--sweep-brightness=", 19) == 0) {
+      if (sscanf(arg + 19, "%d:%d:%d", &option->sweep_min, &option->sweep_max, &option->sweep_step) != 3) return -1;
+      if (option->sweep_step <= 0 || option->sweep_min > option->sweep_max) return -1;
+    } else if (strncmp(arg, "--sweep-top=", 12) == 0) {
+      option->sweep_top = atoi(arg + 12);
+      if (option->sweep_top <= 0) return -1;
+    } else if (strcmp(arg, "--align") == 0) {
+      option->align = ALIGN_TOP;
+    } else if (strncmp(arg, "--align=", 8) == 0) {
+      option->align = atoi(arg + 8);
+      if (option->align <= 0) return -1;
+    } else if (strncmp(arg, "--refine=", 9) == 0) {
+      option->refine = atoi(arg + 9);
+      if (option->refine <= 0) return -1;
+    } else if (strncmp(arg, "--anneal=", 9) == 0) {
+      option->anneal = atoi(arg + 9);
+      if (option->anneal <= 0) return -1;
+    } else if (strncmp(arg, "--replicas=", 11) == 0) {
+      option->replicas = atoi(arg + 11);
+      if (option->replicas <= 0) return -1;
+    } else if (strncmp(arg, "--seam=", 7) == 0) {
+      option->seam = atoi(arg + 7);
+      if (option->seam < 0) return -1;
+    } else if (strncmp(arg, "--grid=", 7) == 0) {
+      if (sscanf(arg + 7, "%dx%d", &option->grid_width, &option->grid_height) != 2) return -1;
+      if (option->grid_width <= 0 || option->grid_height <= 0) return -1;
+    } else if (strncmp(arg, "--parts=", 8) == 0) {
+      option->parts_size = atoi(arg + 8);
+      if (option->parts_size <= 0) return -1;
+    } else if (strcmp(arg, "--color=gray") == 0) {
+      option->color = COLOR_GRAY;
+    } else if (strcmp(arg, "--color=rgb") == 0) {
+      option->color = COLOR_RGB;
+    } else if (strcmp(arg, "--color=ycbcr") == 0) {
+      option->color = COLOR_YCBCR;
+    } else if (strncmp(arg, "--convert=", 10) == 0) {
+      option->convert = arg + 10;
+    } else if (strncmp(arg, "--batch=", 8) == 0) {
+      option->batch = arg + 8;
+    } else if (strncmp(arg, "--bench=", 8) == 0) {
+      option->bench = atoi(arg + 8);
+      if (option->bench <= 0) return -1;
+    } else if (strncmp(arg, "--base=", 7) == 0) {
+      option->base_file = arg + 7;
+    } else if (strncmp(arg, "--target=", 9) == 0) {
+      option->target_file = arg + 9;
+    } else if (strncmp(arg, "--seq=", 6) == 0) {
+      option->result_txt = arg + 6;
+    } else if (strncmp(arg, "--bmp=", 6) == 0) {
+      option->result_bmp = arg + 6;
+    } else if (strncmp(arg, "--cost=", 7) == 0) {
+      option->cost_file = arg + 7;
+    } else {
+      return -1;
+    }
+  }
+  // 座標は X軸と Y軸をセットで指定する
+  if (option->argc == 1) return -1;
+  // 近傍探索と直接計算はコストを持たないため、コストを使う処理とは組み合わせられない
+  if (option->direct && option->solver != SOLVER_GREEDY) return -1;
+  if ((option->solver == SOLVER_ANN || option->direct) && (option->refine > 0 || option->anneal > 0 || option->gap)) return -1;
+  // 下界・索引・境界の差異は輝度の 1 平面のみを扱うため、カラーでは使えない
+  if (option->color != COLOR_GRAY && (option->solver == SOLVER_ANN || option->direct || option->anneal > 0)) return -1;
+
+  // 一括処理では対象画像毎に出力ファイル名を決め、並び替え以外の処理は行わない
+  if (option->batch != NULL && (option->argc > 0 || option->sweep || option->align > 0 || option->refine > 0 || option->anneal > 0 || option->gap ||
+                                option->result_txt != NULL || option->result_bmp != NULL || option->cost_file != NULL)) return -1;
+  // 計測は並び替えまでの各段階のみを対象とする
+  if (option->bench > 0 && (option->sweep || option->align > 0 || option->refine > 0 || option->anneal > 0 || option->gap || option->convert != NULL)) return -1;
+
+  // 出力ファイル名は対象画像のファイル名から決める(kitazato_parts_white.txt → kitazato_seq.txt)
+  if (option->result_txt == NULL) {
+    create_result_name(option->result_txt_buffer, FILE_NAME_SIZE, option->target_file, RESULT_TXT);
+    option->result_txt = option->result_txt_buffer;
+  }
+  if (option->result_bmp == NULL) {
+    create_result_name(option->result_bmp_buffer, FILE_NAME_SIZE, option->target_file, RESULT_BMP);
+    option->result_bmp = option->result_bmp_buffer;
+  }
+  if (option->cost_file == NULL) {
+    create_result_name(option->cost_file_buffer, FILE_NAME_SIZE, option->target_file, COST_FILE_NAME);
+    option->cost_file = option->cost_file_buffer;
+  }
+  return 0;
 }
 
 //////////////////////////////
-// 2 つのパーツの差異を数値化
+// 二乗誤差の総和(スカラー版)
 //////////////////////////////
-double diff(position_t const* const pa, position_t const* const pb) {
-  uint64_t sum = 0;
-  for (int py = 0; py < PARTS_HEIGHT; ++ py) {
-    for (int px = 0; px < PARTS_WIDTH; ++ px) {
-      uint64_t const dist = pa->parts->brightness[pa->rotation][py][px] - pb->parts->brightness[pb->rotation][py][px];
-      sum += dist * dist;
+template <int SIZE>
+uint32_t ssd_scalar(uint8_t const* const a, uint8_t const* const b, int const size) {
+  int const n = (SIZE > 0) ? SIZE : size;
+  uint32_t sum = 0;
+  for (int i = 0; i < n; ++ i) {
+    int const dist = a[i] - b[i];
+    sum += dist * dist;
+  }
+  return sum;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//////////////////////////////
+// 二乗誤差の総和(SSE2版)
+//////////////////////////////
+template <int SIZE>
+__attribute__((target("sse2")))
+uint32_t ssd_sse2(uint8_t const* const a, uint8_t const* const b, int const size) {
+  int const n = (SIZE > 0) ? SIZE : size;
+  __m128i const zero = _mm_setzero_si128();
+  __m128i acc = _mm_setzero_si128();
+  int i = 0;
+  // 16 画素ずつ 16bit に拡張して差分を取り、積和で 32bit に集約する
+  for (; i + 16 <= n; i += 16) {
+    __m128i const va = _mm_loadu_si128((__m128i const*)(a + i));
+    __m128i const vb = _mm_loadu_si128((__m128i const*)(b + i));
+    __m128i const lo = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero));
+    __m128i const hi = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero));
+    acc = _mm_add_epi32(acc, _mm_madd_epi16(lo, lo));
+    acc = _mm_add_epi32(acc, _mm_madd_epi16(hi, hi));
+  }
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+  uint32_t sum = (uint32_t)_mm_cvtsi128_si32(acc);
+  // 端数はスカラーで処理(パーツの境界を越えて読まない)
+  for (; i < n; ++ i) {
+    int const dist = a[i] - b[i];
+    sum += dist * dist;
+  }
+  return sum;
+}
+
+//////////////////////////////
+// 二乗誤差の総和(AVX2版)
+//////////////////////////////
+template <int SIZE>
+__attribute__((target("avx2")))
+uint32_t ssd_avx2(uint8_t const* const a, uint8_t const* const b, int const size) {
+  int const n = (SIZE > 0) ? SIZE : size;
+  __m256i const zero = _mm256_setzero_si256();
+  __m256i acc = _mm256_setzero_si256();
+  int i = 0;
+  // 32 画素ずつ(レーン内の並びは総和に影響しない)
+  for (; i + 32 <= n; i += 32) {
+    __m256i const va = _mm256_loadu_si256((__m256i const*)(a + i));
+    __m256i const vb = _mm256_loadu_si256((__m256i const*)(b + i));
+    __m256i const lo = _mm256_sub_epi16(_mm256_unpacklo_epi8(va, zero), _mm256_unpacklo_epi8(vb, zero));
+    __m256i const hi = _mm256_sub_epi16(_mm256_unpackhi_epi8(va, zero), _mm256_unpackhi_epi8(vb, zero));
+    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(lo, lo));
+    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(hi, hi));
+  }
+  // 16 画素の端数
+  if (i + 16 <= n) {
+    __m256i const va = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i const*)(a + i)));
+    __m256i const vb = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i const*)(b + i)));
+    __m256i const d = _mm256_sub_epi16(va, vb);
+    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(d, d));
+    i += 16;
+  }
+  __m128i sum128 = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+  sum128 = _mm_add_epi32(sum128, _mm_shuffle_epi32(sum128, _MM_SHUFFLE(1, 0, 3, 2)));
+  sum128 = _mm_add_epi32(sum128, _mm_shuffle_epi32(sum128, _MM_SHUFFLE(2, 3, 0, 1)));
+  uint32_t sum = (uint32_t)_mm_cvtsi128_si32(sum128);
+  // 端数はスカラーで処理(パーツの境界を越えて読まない)
+  for (; i < n; ++ i) {
+    int const dist = a[i] - b[i];
+    sum += dist * dist;
+  }
+  return sum;
+}
+#endif
+
+//////////////////////////////
+// 二乗誤差の関数の一覧
+// パーツの一辺が 8, 10, 16, 32 の場合のパーツ全体(一辺の二乗)と境界(一辺)の画素数
+//////////////////////////////
+#if defined(__x86_64__) || defined(__i386__)
+#define SSD_ENTRY(n) { n, ssd_scalar<n>, ssd_sse2<n>, ssd_avx2<n> }
+#else
+#define SSD_ENTRY(n) { n, ssd_scalar<n> }
+#endif
+ssd_kernel_t const SSD_KERNEL[] = {
+  SSD_ENTRY(8 * 8), SSD_ENTRY(10 * 10), SSD_ENTRY(16 * 16), SSD_ENTRY(32 * 32),
+  SSD_ENTRY(8), SSD_ENTRY(10), SSD_ENTRY(16), SSD_ENTRY(32),
+  SSD_ENTRY(0) // 汎用版(番兵)
+};
+#undef SSD_ENTRY
+
+//////////////////////////////
+// 画素数と CPU に合わせて二乗誤差の関数を選択
+// よく使う画素数は定数で展開したものを使い、それ以外は汎用版(SIZE = 0)を使う
+//////////////////////////////
+ssd_func_t select_ssd(int const size) {
+  int k = 0;
+  while (SSD_KERNEL[k].size != 0 && SSD_KERNEL[k].size != size) ++ k;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return SSD_KERNEL[k].avx2;
+  if (__builtin_cpu_supports("sse2")) return SSD_KERNEL[k].sse2;
+#endif
+  return SSD_KERNEL[k].scalar;
+}
+
+//////////////////////////////
+// 2x2 ブロックの重み付き二乗誤差の総和(スカラー版)
+// size は 16 の倍数(端数は重み 0 で埋めてある)
+//////////////////////////////
+uint32_t lowres_scalar(uint16_t const* const a, uint16_t const* const b, uint16_t const* const weight, int const size) {
+  uint32_t sum = 0;
+  for (int i = 0; i < size; ++ i) {
+    int const dist = (int)a[i] - b[i];
+    sum += (uint32_t)(dist * dist) * weight[i];
+  }
+  return sum;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//////////////////////////////
+// 2x2 ブロックの重み付き二乗誤差の総和(SSE2版)
+// ブロックの総和は 1020 以下、重みは 4 以下のため 16bit のまま積を取れる
+//////////////////////////////
+__attribute__((target("sse2")))
+uint32_t lowres_sse2(uint16_t const* const a, uint16_t const* const b, uint16_t const* const weight, int const size) {
+  __m128i acc = _mm_setzero_si128();
+  for (int i = 0; i < size; i += 8) {
+    __m128i const d = _mm_sub_epi16(_mm_loadu_si128((__m128i const*)(a + i)), _mm_loadu_si128((__m128i const*)(b + i)));
+    __m128i const w = _mm_loadu_si128((__m128i const*)(weight + i));
+    acc = _mm_add_epi32(acc, _mm_madd_epi16(d, _mm_mullo_epi16(d, w)));
+  }
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+  return (uint32_t)_mm_cvtsi128_si32(acc);
+}
+
+//////////////////////////////
+// 2x2 ブロックの重み付き二乗誤差の総和(AVX2版)
+//////////////////////////////
+__attribute__((target("avx2")))
+uint32_t lowres_avx2(uint16_t const* const a, uint16_t const* const b, uint16_t const* const weight, int const size) {
+  __m256i acc = _mm256_setzero_si256();
+  for (int i = 0; i < size; i += 16) {
+    __m256i const d = _mm256_sub_epi16(_mm256_loadu_si256((__m256i const*)(a + i)), _mm256_loadu_si256((__m256i const*)(b + i)));
+    __m256i const w = _mm256_loadu_si256((__m256i const*)(weight + i));
+    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(d, _mm256_mullo_epi16(d, w)));
+  }
+  __m128i sum128 = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+  sum128 = _mm_add_epi32(sum128, _mm_shuffle_epi32(sum128, _MM_SHUFFLE(1, 0, 3, 2)));
+  sum128 = _mm_add_epi32(sum128, _mm_shuffle_epi32(sum128, _MM_SHUFFLE(2, 3, 0, 1)));
+  return (uint32_t)_mm_cvtsi128_si32(sum128);
+}
+#endif
+
+//////////////////////////////
+// CPU に合わせて 2x2 ブロックの重み付き二乗誤差の関数を選択
+//////////////////////////////
+lowres_func_t select_lowres() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return lowres_avx2;
+  if (__builtin_cpu_supports("sse2")) return lowres_sse2;
+#endif
+  return lowres_scalar;
+}
+
+//////////////////////////////
+// パーツの輝度の先頭(rotation は保持している回転であること)
+//////////////////////////////
+uint8_t* get_brightness(image_t const* const image, int const parts, int const rotation) {
+  return &image->brightness[((size_t)parts * image->rotations + rotation) * image->channels * image->pixels];
+}
+
+//////////////////////////////
+// 回転 0 の輝度を指定した回数だけ 90度回転する
+//////////////////////////////
+void rotate_brightness(uint8_t* const dst, uint8_t const* const src, int const parts_size, int const rotation) {
+  for (int py = 0; py < parts_size; ++ py) {
+    for (int px = 0; px < parts_size; ++ px) {
+      int qx = px;
+      int qy = py;
+      for (int r = 0; r < rotation; ++ r) {
+        int const tmp = qx;
+        qx = qy;
+        qy = parts_size - tmp - 1;
+      }
+      dst[qy * parts_size + qx] = src[py * parts_size + px];
     }
   }
-  return sqrt(sum);
+}
+
+//////////////////////////////
+// 回転したパーツの輝度(保持していない回転は buffer に生成して返す)
+//////////////////////////////
+uint8_t const* get_rotated_brightness(image_t const* const image, int const parts, int const rotation, uint8_t* const buffer) {
+  if (rotation < image->rotations) {
+    return get_brightness(image, parts, rotation);
+  }
+  uint8_t const* const src = get_brightness(image, parts, 0);
+  for (int c = 0; c < image->channels; ++ c) {
+    rotate_brightness(&buffer[c * image->pixels], &src[c * image->pixels], image->parts_size, rotation);
+  }
+  return buffer;
+}
+
+//////////////////////////////
+// 2 つのパーツの差異を数値化(二乗誤差の総和)
+// ベースパーツを position の回転で比較する。
+// 画素の並べ替えは二乗誤差を変えないため、ベース画像が回転 0 しか持たない場合は
+// 対象パーツを逆向きに回転したものと比較する。
+// カラーは色の平面毎に同じ関数で二乗誤差を求め、色毎の重みを掛けて足す
+//////////////////////////////
+uint32_t diff(image_t const* const target_image, int const target, image_t const* const base_image, position_t const* const position) {
+  uint8_t const* a = NULL;
+  uint8_t const* b = NULL;
+  if (base_image->rotations > 1) {
+    a = get_brightness(target_image, target, 0);
+    b = get_brightness(base_image, position->parts, position->rotation);
+  } else {
+    a = get_brightness(target_image, target, (ROTATION_SIZE - position->rotation) % ROTATION_SIZE);
+    b = get_brightness(base_image, position->parts, 0);
+  }
+  int const pixels = target_image->pixels;
+  if (target_image->channels == 1) {
+    return target_image->ssd(a, b, pixels);
+  }
+  uint32_t const* const weight = COLOR_WEIGHT[target_image->color];
+  uint32_t value = 0;
+  for (int c = 0; c < target_image->channels; ++ c) {
+    value += weight[c] * target_image->ssd(&a[c * pixels], &b[c * pixels], pixels);
+  }
+  return value;
+}
+
+//////////////////////////////
+// 探索順リストのメモリ確保
+//////////////////////////////
+order_t* alloc_order(int const size) {
+  order_t* order = (order_t*)malloc(sizeof(order_t));
+  if (order == NULL) {
+    return NULL;
+  }
+  order->size = size;
+  order->coord = (coord_t*)malloc(sizeof(coord_t) * size);
+  if (order->coord == NULL) {
+    free(order);
+    return NULL;
+  }
+  return order;
 }
 
 //////////////////////////////
 // 探索順リストの生成(昇順)
 //////////////////////////////
-order_t* create_order_by_asc() {
+order_t* create_order_by_asc(int const width, int const height) {
   // メモリ確保
-  order_t* order = (order_t*)malloc(sizeof(order_t));
+  order_t* order = alloc_order(width * height);
   if (order == NULL) {
     return NULL;
   }
 
   int idx = 0;
-  for (int iy = 0; iy < IMAGE_HEIGHT; ++ iy) {
-    for (int ix = 0; ix < IMAGE_WIDTH; ++ ix) {
+  for (int iy = 0; iy < height; ++ iy) {
+    for (int ix = 0; ix < width; ++ ix) {
       coord_t coord;
       coord.x = ix;
       coord.y = iy;
@@ -269,16 +1233,16 @@ order_t* create_order_by_asc() {
 //////////////////////////////
 // 探索順リストの生成(降順)
 //////////////////////////////
-order_t* create_order_by_desc() {
+order_t* create_order_by_desc(int const width, int const height) {
   // メモリ確保
-  order_t* order = (order_t*)malloc(sizeof(order_t));
+  order_t* order = alloc_order(width * height);
   if (order == NULL) {
     return NULL;
   }
 
-  int idx = IMAGE_HEIGHT * IMAGE_WIDTH - 1;
-  for (int iy = 0; iy < IMAGE_HEIGHT; ++ iy) {
-    for (int ix = 0; ix < IMAGE_WIDTH; ++ ix) {
+  int idx = width * height - 1;
+  for (int iy = 0; iy < height; ++ iy) {
+    for (int ix = 0; ix < width; ++ ix) {
       coord_t coord;
       coord.x = ix;
       coord.y = iy;
@@ -292,19 +1256,22 @@ order_t* create_order_by_desc() {
 //////////////////////////////
 // 探索順リストの生成(中心から)
 //////////////////////////////
-order_t* create_order_by_center() {
+order_t* create_order_by_center(int const width, int const height) {
   // メモリ確保
-  order_t* order = (order_t*)malloc(sizeof(order_t));
-  if (order == NULL) {
+  order_t* order = alloc_order(width * height);
+  bool* exist = (bool*)calloc(width * height, sizeof(bool));
+  if (order == NULL || exist == NULL) {
+    free(exist);
+    free_order(order);
     return NULL;
   }
-  bool exist[IMAGE_HEIGHT][IMAGE_WIDTH] = { false };
   int idx = 0;
-  for (int m = (IMAGE_HEIGHT >> 1) - 1; m >= 0; -- m) {
-    for (int iy = m; iy < IMAGE_HEIGHT - m; ++ iy) {
-      for (int ix = m; ix < IMAGE_WIDTH - m; ++ ix) {
-        if (!exist[iy][ix]) {
-          exist[iy][ix] = true;
+  int const half = ((width > height ? width : height) + 1) >> 1;
+  for (int m = half - 1; m >= 0; -- m) {
+    for (int iy = m; iy < height - m; ++ iy) {
+      for (int ix = m; ix < width - m; ++ ix) {
+        if (!exist[iy * width + ix]) {
+          exist[iy * width + ix] = true;
           coord_t coord;
           coord.x = ix;
           coord.y = iy;
@@ -313,276 +1280,3531 @@ order_t* create_order_by_center() {
       }
     }
   }
+  free(exist);
   return order;
 }
 
+//////////////////////////////
+// 探索順リストの開放
+//////////////////////////////
+void free_order(order_t* const order) {
+  if (order == NULL) return;
+  free(order->coord);
+  free(order);
+}
+
 //////////////////////////////
 // 座標を動かす
+// 回転 0 を動かしてから、保持している回転を作り直す
 //////////////////////////////
 void add_coord(image_t* const image, int dx, int dy) {
-  // dx %= PARTS_HEIGHT;
-  // dy %= PARTS_HEIGHT;
-  for (int iy = 0; iy < IMAGE_HEIGHT; ++ iy) {
-    for (int ix = 0; ix < IMAGE_WIDTH; ++ ix) {
-      for (int r = 0; r < ROTATION_SIZE; ++ r) {
-        for (int py = 0; py < PARTS_HEIGHT; ++ py) {
-          for (int px = 0; px < PARTS_WIDTH; ++ px) {
-            int iy2 = iy;
-            int py2 = py + dy;
-            if (py2 >= PARTS_HEIGHT) {
-              py2 -= PARTS_HEIGHT;
-              if (++ iy2 >= IMAGE_HEIGHT) continue;
-            } else if (py2 < 0) {
-              py2 += PARTS_HEIGHT;
-              if (-- iy2 < 0) continue;
-            }
-            int ix2 = ix;
-            int px2 = px + dx;
-            if (px2 >= PARTS_WIDTH) {
-              px2 -= PARTS_WIDTH;
-              if (++ ix2 >= IMAGE_WIDTH) continue;
-            } else if (px2 < 0) {
-              px2 += PARTS_WIDTH;
-              if (-- ix2 < 0) continue;
-            }
-            image->parts[iy2][ix2].brightness[r][py2][px2] = image->parts[iy][ix].brightness[r][py][px];
+  int const parts_size = image->parts_size;
+  // dx %= parts_size;
+  // dy %= parts_size;
+  for (int iy = 0; iy < image->height; ++ iy) {
+    for (int ix = 0; ix < image->width; ++ ix) {
+      uint8_t const* const src = get_brightness(image, iy * image->width + ix, 0);
+      for (int py = 0; py < parts_size; ++ py) {
+        for (int px = 0; px < parts_size; ++ px) {
+          int iy2 = iy;
+          int py2 = py + dy;
+          if (py2 >= parts_size) {
+            py2 -= parts_size;
+            if (++ iy2 >= image->height) continue;
+          } else if (py2 < 0) {
+            py2 += parts_size;
+            if (-- iy2 < 0) continue;
+          }
+          int ix2 = ix;
+          int px2 = px + dx;
+          if (px2 >= parts_size) {
+            px2 -= parts_size;
+            if (++ ix2 >= image->width) continue;
+          } else if (px2 < 0) {
+            px2 += parts_size;
+            if (-- ix2 < 0) continue;
+          }
+          uint8_t* const dst = get_brightness(image, iy2 * image->width + ix2, 0);
+          for (int c = 0; c < image->channels; ++ c) {
+            dst[c * image->pixels + py2 * parts_size + px2] = src[c * image->pixels + py * parts_size + px];
           }
         }
       }
     }
   }
+  for (int i = 0; i < image->size; ++ i) {
+    rotate_parts(image, i);
+  }
 }
 
 //////////////////////////////
 // 輝度を増やす
+// RGB は全ての色、YCbCr は Y のみを変える
 //////////////////////////////
 void add_brightness(image_t* const image, int value) {
-  for (int iy = 0; iy < IMAGE_HEIGHT; ++ iy) {
-    for (int ix = 0; ix < IMAGE_WIDTH; ++ ix) {
-      parts_t* const parts = &image->parts[iy][ix];
-      for (int r = 0; r < ROTATION_SIZE; ++ r) {
-        for (int py = 0; py < PARTS_HEIGHT; ++ py) {
-          for (int px = 0; px < PARTS_WIDTH; ++ px) {
-            int brightness = parts->brightness[r][py][px];
-            brightness += value;
-            if (brightness < 0) {
-              brightness = 0;
-            } else if (brightness > 255) {
-              brightness = 255;
-            }
-            parts->brightness[r][py][px] = (uint8_t)brightness;
-          }
-        }
+  size_t const count = (size_t)image->size * image->rotations;
+  size_t const stride = (size_t)image->channels * image->pixels;
+  size_t const lit = (size_t)COLOR_LIT[image->color] * image->pixels;
+  for (size_t i = 0; i < count; ++ i) {
+    uint8_t* const data = &image->brightness[i * stride];
+    for (size_t k = 0; k < lit; ++ k) {
+      int brightness = data[k];
+      brightness += value;
+      if (brightness < 0) {
+        brightness = 0;
+      } else if (brightness > 255) {
+        brightness = 255;
       }
+      data[k] = (uint8_t)brightness;
     }
   }
 }
 
 //////////////////////////////
-// モザイクの並び替え
+// 画像オブジェクトのハッシュ値(FNV-1a)
 //////////////////////////////
-void sort_mosaic(order_t const* const order, image_t* const base_image, image_t* const target_image, mosaic_t* const mosaic) {
-  // 与えられた順番にパーツを探索
-  for (int i = 0; i < IMAGE_HEIGHT * IMAGE_WIDTH; ++ i) {
-    coord_t const coord = order->coord[i];
-    parts_t* const target_parts = &target_image->parts[coord.y][coord.x];
-    // 重複していたら終了
-    if (target_parts->locked) {
-      printf("parts[%d][%d] is locked.\n", coord.y, coord.x);
-      return;
-    }
-    // 最も差分が小さいパーツを探索
-    double best_value = 100000;
-    int best_rotation = 0;
-    parts_t* best_parts = NULL;
-    for (int iy = 0; iy < IMAGE_HEIGHT; ++ iy) {
-      for (int ix = 0; ix < IMAGE_WIDTH; ++ ix) {
-        parts_t* const base_parts = &base_image->parts[iy][ix];
-        if (base_parts->locked) continue;
-        position_t position;
-        position.parts = base_parts;
-        for (int r = 0; r < ROTATION_SIZE; ++ r) {
-          position.rotation = r;
-          double const value = diff(target_parts, &position);
-          if (value < best_value) {
-            best_value = value;
-            best_rotation = r;
-            best_parts = base_parts;
-          }
-        }
-      }
+uint64_t hash_image(image_t const* const image) {
+  uint64_t hash = 0xCBF29CE484222325ULL;
+  hash = (hash ^ (uint32_t)image->parts_size) * 0x100000001B3ULL;
+  for (int i = 0; i < image->size; ++ i) {
+    uint8_t const* const data = get_brightness(image, i, 0);
+    for (int p = 0; p < image->channels * image->pixels; ++ p) {
+      hash = (hash ^ data[p]) * 0x100000001B3ULL;
     }
-    // パーツを確定する
-    position_t position;
-    position.rotation = best_rotation;
-    position.parts = best_parts;
-    mosaic->position[coord.y][coord.x] = position;
-    best_parts->locked = true;
-    target_parts->locked = true;
+    hash = (hash ^ (uint32_t)image->no[i]) * 0x100000001B3ULL;
   }
+  return hash;
 }
 
 //////////////////////////////
-// 画像オブジェクトが全て使用されたかチェック
+// コストオブジェクトのメモリ確保
 //////////////////////////////
-bool check_image(image_t const* const image) {
-  for (int iy = 0; iy < IMAGE_HEIGHT; ++ iy) {
-    for (int ix = 0; ix < IMAGE_WIDTH; ++ ix) {
-      if (!image->parts[iy][ix].locked) {
-        return false;
-      }
-    }
+cost_t* alloc_cost(int const target_size, int const base_size) {
+  cost_t* cost = (cost_t*)malloc(sizeof(cost_t));
+  if (cost == NULL) {
+    return NULL;
   }
-  return true;
+  // キャッシュラインに揃える
+  size_t size = sizeof(uint32_t) * target_size * base_size * ROTATION_SIZE;
+  size = (size + COST_ALIGN - 1) / COST_ALIGN * COST_ALIGN;
+  void* value = NULL;
+  if (posix_memalign(&value, COST_ALIGN, size) != 0) {
+    free(cost);
+    return NULL;
+  }
+  cost->target_size = target_size;
+  cost->base_size = base_size;
+  cost->value = (uint32_t*)value;
+  return cost;
 }
 
 //////////////////////////////
-// モザイクに全てのパーツが使用されているかチェック
+// 画像オブジェクトからコストオブジェクトの生成
 //////////////////////////////
-bool check_mosaic(mosaic_t const* const mosaic) {
-  bool exist[IMAGE_HEIGHT * IMAGE_WIDTH] = { false };
-  for (int iy = 0; iy < IMAGE_HEIGHT; ++ iy) {
-    for (int ix = 0; ix < IMAGE_WIDTH; ++ ix) {
-      exist[mosaic->position[iy][ix].parts->no - 1] = true;
-    }
+cost_t* create_cost_by_image(image_t const* const base_image, image_t const* const target_image) {
+  int const base_size = base_image->size;
+  cost_t* cost = alloc_cost(target_image->size, base_size);
+  if (cost == NULL) {
+    return NULL;
   }
-  for (int i = 0; i < IMAGE_HEIGHT * IMAGE_WIDTH; ++ i) {
-    if (!exist[i]) {
-      return false;
+
+  // 対象パーツ毎に全てのベースパーツ・回転との差異を計算
+  #pragma omp parallel for schedule(static)
+  for (int t = 0; t < target_image->size; ++ t) {
+    uint32_t* const row = &cost->value[(size_t)t * base_size * ROTATION_SIZE];
+    for (int b = 0; b < base_size; ++ b) {
+      position_t position;
+      position.parts = b;
+      for (int r = 0; r < ROTATION_SIZE; ++ r) {
+        position.rotation = r;
+        row[b * ROTATION_SIZE + r] = diff(target_image, t, base_image, &position);
+      }
     }
   }
-  return true;
+
+  return cost;
 }
 
 //////////////////////////////
-// TXTから画像オブジェクトの生成
+// ファイルからコストオブジェクトの生成
 //////////////////////////////
-image_t* create_image_by_txt(char const* const file_name) {
-  FILE* fp = fopen(file_name, "r");
+cost_t* create_cost_by_file(char const* const file_name, image_t const* const base_image, image_t const* const target_image) {
+  FILE* fp = fopen(file_name, "rb");
   if (fp == NULL) return NULL;
 
+  // ヘッダーが一致しなければ再利用しない
+  cost_header_t header;
+  if (fread(&header, sizeof(header), 1, fp) < 1 ||
+      header.magic != COST_MAGIC ||
+      header.target_size != target_image->size ||
+      header.base_size != base_image->size ||
+      header.rotation != ROTATION_SIZE ||
+      header.base_hash != hash_image(base_image) ||
+      header.target_hash != hash_image(target_image)) {
+    fclose(fp);
+    return NULL;
+  }
+
   // メモリ確保
-  image_t* image = (image_t*)malloc(sizeof(image_t));
-  if (image == NULL) {
+  cost_t* cost = alloc_cost(target_image->size, base_image->size);
+  if (cost == NULL) {
     fclose(fp);
     return NULL;
   }
 
   // ファイル読み込み
-  for (int iy = 0; iy < IMAGE_HEIGHT; ++ iy) {
-    for (int ix = 0; ix < IMAGE_WIDTH; ++ ix) {
-      parts_t* const parts = &(image->parts[iy][ix]);
-      parts->locked = false;
-      if (fscanf(fp, "%d", &(parts->no)) == EOF) {
-        fclose(fp);
-        free(image);
-        return NULL;
-      }
-      for (int py = 0; py < PARTS_HEIGHT; ++ py) {
-        for (int px = 0; px < PARTS_WIDTH; ++ px) {
-          int brightness = 0;
-          if (fscanf(fp, "%d", &brightness) == EOF) {
-            fclose(fp);
-            free(image);
-            return NULL;
-          }
-          parts->brightness[0][py][px] = (uint8_t)brightness;
-        }
-      }
-      // 90度回転した画像情報を生成
-      for (int r = 1; r < ROTATION_SIZE; ++ r) {
-        for (int py = 0; py < PARTS_HEIGHT; ++ py) {
-          for (int px = 0; px < PARTS_WIDTH; ++ px) {
-            parts->brightness[r][PARTS_HEIGHT - px - 1][py] = parts->brightness[r - 1][py][px];
-          }
-        }
-      }
+  size_t const count = (size_t)target_image->size * base_image->size * ROTATION_SIZE;
+  if (fread(cost->value, sizeof(uint32_t), count, fp) < count) {
+    free_cost(cost);
+    fclose(fp);
+    return NULL;
+  }
+
+  fclose(fp);
+  return cost;
+}
+
+//////////////////////////////
+// コストオブジェクトをファイルにエクスポート
+//////////////////////////////
+int export_cost_to_file(char const* const file_name, cost_t const* const cost, image_t const* const base_image, image_t const* const target_image) {
+  FILE* fp = fopen(file_name, "wb");
+  if (fp == NULL) return -1;
+
+  cost_header_t header;
+  header.magic = COST_MAGIC;
+  header.target_size = cost->target_size;
+  header.base_size = cost->base_size;
+  header.rotation = ROTATION_SIZE;
+  header.base_hash = hash_image(base_image);
+  header.target_hash = hash_image(target_image);
+  if (fwrite(&header, sizeof(header), 1, fp) < 1) {
+    fclose(fp);
+    return -1;
+  }
+
+  size_t const count = (size_t)cost->target_size * cost->base_size * ROTATION_SIZE;
+  if (fwrite(cost->value, sizeof(uint32_t), count, fp) < count) {
+    fclose(fp);
+    return -1;
+  }
+
+  fclose(fp);
+  return 0;
+}
+
+//////////////////////////////
+// コストオブジェクトの開放
+//////////////////////////////
+void free_cost(cost_t* const cost) {
+  if (cost == NULL) return;
+  free(cost->value);
+  free(cost);
+}
+
+//////////////////////////////
+// 画像オブジェクトからパーツ毎の統計量を生成
+//////////////////////////////
+moment_t* create_moment_by_image(image_t const* const image) {
+  // メモリ確保
+  moment_t* moment = (moment_t*)malloc(sizeof(moment_t));
+  if (moment == NULL) {
+    return NULL;
+  }
+  int const size = image->size;
+  moment->size = size;
+  moment->sum = (int32_t*)malloc(sizeof(int32_t) * size);
+  moment->min = (uint8_t*)malloc(sizeof(uint8_t) * size);
+  moment->max = (uint8_t*)malloc(sizeof(uint8_t) * size);
+  if (moment->sum == NULL || moment->min == NULL || moment->max == NULL) {
+    free_moment(moment);
+    return NULL;
+  }
+
+  // 回転しても変わらないため回転 0 のみを集計する
+  // カラーは輝度を変える色のみを、二乗誤差と同じ重みを掛けて集計する
+  uint32_t const* const weight = COLOR_WEIGHT[image->color];
+  for (int i = 0; i < size; ++ i) {
+    uint8_t const* const data = get_brightness(image, i, 0);
+    int32_t sum = 0;
+    uint8_t min = 255;
+    uint8_t max = 0;
+    for (int c = 0; c < COLOR_LIT[image->color]; ++ c) {
+      uint8_t const* const plane = &data[c * image->pixels];
+      for (int p = 0; p < image->pixels; ++ p) {
+        sum += weight[c] * plane[p];
+        if (plane[p] < min) min = plane[p];
+        if (plane[p] > max) max = plane[p];
+      }
+    }
+    moment->sum[i] = sum;
+    moment->min[i] = min;
+    moment->max[i] = max;
+  }
+
+  return moment;
+}
+
+//////////////////////////////
+// 統計量オブジェクトの開放
+//////////////////////////////
+void free_moment(moment_t* const moment) {
+  if (moment == NULL) return;
+  free(moment->sum);
+  free(moment->min);
+  free(moment->max);
+  free(moment);
+}
+
+//////////////////////////////
+// 輝度を増加させた場合のコストを差分で求める
+// 対象パーツ t に b を足すと SSD(b) = SSD(0) + 2b(Σt - Σs) + n b^2 となる
+// (カラーは輝度を変える色毎の式に重みを掛けて足すため、総和は重み付き、n は画素数 x 重みの和)。
+// 0/255 で飽和するパーツだけは輝度を足した対象画像から計算し直す。
+// src は輝度を足す前のコスト、target_moment は輝度を足す前の統計量、
+// target_image は輝度を足した後の画像を渡す(dst と src は同じでもよい)。
+// 戻り値は計算し直したパーツ数
+//////////////////////////////
+int update_cost_by_brightness(cost_t* const dst, cost_t const* const src, moment_t const* const base_moment, moment_t const* const target_moment, image_t const* const base_image, image_t const* const target_image, int const brightness) {
+  int n = 0;
+  for (int c = 0; c < COLOR_LIT[target_image->color]; ++ c) {
+    n += target_image->pixels * (int)COLOR_WEIGHT[target_image->color][c];
+  }
+  int const base_size = src->base_size;
+  int64_t const square = (int64_t)n * brightness * brightness;
+  int clamped = 0;
+
+  #pragma omp parallel for schedule(static) reduction(+:clamped)
+  for (int t = 0; t < src->target_size; ++ t) {
+    uint32_t const* const in = &src->value[(size_t)t * base_size * ROTATION_SIZE];
+    uint32_t* const out = &dst->value[(size_t)t * base_size * ROTATION_SIZE];
+    if (target_moment->min[t] + brightness < 0 || target_moment->max[t] + brightness > 255) {
+      // 飽和するため直接計算する
+      for (int b = 0; b < base_size; ++ b) {
+        position_t position;
+        position.parts = b;
+        for (int r = 0; r < ROTATION_SIZE; ++ r) {
+          position.rotation = r;
+          out[b * ROTATION_SIZE + r] = diff(target_image, t, base_image, &position);
+        }
+      }
+      ++ clamped;
+      continue;
+    }
+    int64_t const target_sum = target_moment->sum[t];
+    for (int b = 0; b < base_size; ++ b) {
+      int64_t const delta = 2 * brightness * (target_sum - base_moment->sum[b]) + square;
+      for (int r = 0; r < ROTATION_SIZE; ++ r) {
+        out[b * ROTATION_SIZE + r] = (uint32_t)((int64_t)in[b * ROTATION_SIZE + r] + delta);
+      }
+    }
+  }
+
+  return clamped;
+}
+
+//////////////////////////////
+// コストオブジェクトから回転毎の最小値を抽出
+//////////////////////////////
+min_cost_t* create_min_cost_by_cost(cost_t const* const cost) {
+  // メモリ確保
+  min_cost_t* min_cost = (min_cost_t*)malloc(sizeof(min_cost_t));
+  if (min_cost == NULL) {
+    return NULL;
+  }
+  size_t const count = (size_t)cost->target_size * cost->base_size;
+  min_cost->size = cost->target_size;
+  min_cost->value = (uint32_t*)malloc(sizeof(uint32_t) * count);
+  min_cost->rotation = (uint8_t*)malloc(sizeof(uint8_t) * count);
+  if (min_cost->value == NULL || min_cost->rotation == NULL) {
+    free_min_cost(min_cost);
+    return NULL;
+  }
+
+  // 同値の場合は回転の小さいものを優先
+  #pragma omp parallel for schedule(static)
+  for (int t = 0; t < cost->target_size; ++ t) {
+    for (int b = 0; b < cost->base_size; ++ b) {
+      size_t const idx = (size_t)t * cost->base_size + b;
+      uint32_t const* const value = &cost->value[idx * ROTATION_SIZE];
+      int best_rotation = 0;
+      for (int r = 1; r < ROTATION_SIZE; ++ r) {
+        if (value[r] < value[best_rotation]) {
+          best_rotation = r;
+        }
+      }
+      min_cost->value[idx] = value[best_rotation];
+      min_cost->rotation[idx] = (uint8_t)best_rotation;
+    }
+  }
+
+  return min_cost;
+}
+
+//////////////////////////////
+// 最小コストオブジェクトの開放
+//////////////////////////////
+void free_min_cost(min_cost_t* const min_cost) {
+  if (min_cost == NULL) return;
+  free(min_cost->value);
+  free(min_cost->rotation);
+  free(min_cost);
+}
+
+//////////////////////////////
+// 枝刈り用の下界の生成
+// 画素値の総和・二乗和(回転しても変わらない)と、保持している回転毎の 2x2 ブロックの総和を集計する
+//////////////////////////////
+bound_t* create_bound_by_image(image_t const* const image) {
+  // メモリ確保
+  bound_t* bound = (bound_t*)malloc(sizeof(bound_t));
+  if (bound == NULL) {
+    return NULL;
+  }
+  int const size = image->size;
+  int const parts_size = image->parts_size;
+  int const blocks = (parts_size + 1) / 2;
+  bound->size = size;
+  bound->rotations = image->rotations;
+  bound->blocks = blocks;
+  bound->stride = (blocks * blocks + 15) / 16 * 16;
+  bound->lowres = select_lowres();
+  bound->sum = (int32_t*)malloc(sizeof(int32_t) * size);
+  bound->norm = (double*)malloc(sizeof(double) * size);
+  bound->weight = (uint16_t*)calloc(bound->stride, sizeof(uint16_t));
+  bound->block = (uint16_t*)malloc(sizeof(uint16_t) * size * image->rotations * bound->stride);
+  if (bound->sum == NULL || bound->norm == NULL || bound->weight == NULL || bound->block == NULL) {
+    free_bound(bound);
+    return NULL;
+  }
+
+  // 一辺が奇数の場合は最後の行・列のブロックの画素数が少ない
+  for (int by = 0; by < blocks; ++ by) {
+    for (int bx = 0; bx < blocks; ++ bx) {
+      int const count = ((by * 2 + 1 < parts_size) ? 2 : 1) * ((bx * 2 + 1 < parts_size) ? 2 : 1);
+      bound->weight[by * blocks + bx] = (uint16_t)(4 / count);
+    }
+  }
+
+  #pragma omp parallel for schedule(static)
+  for (int i = 0; i < size; ++ i) {
+    uint8_t const* const data = get_brightness(image, i, 0);
+    int32_t sum = 0;
+    uint64_t energy = 0;
+    for (int p = 0; p < image->pixels; ++ p) {
+      sum += data[p];
+      energy += (uint32_t)data[p] * data[p];
+    }
+    bound->sum[i] = sum;
+    bound->norm[i] = sqrt((double)energy);
+    for (int r = 0; r < image->rotations; ++ r) {
+      uint8_t const* const rotated = get_brightness(image, i, r);
+      uint16_t* const block = &bound->block[((size_t)i * image->rotations + r) * bound->stride];
+      memset(block, 0, sizeof(uint16_t) * bound->stride);
+      for (int py = 0; py < parts_size; ++ py) {
+        for (int px = 0; px < parts_size; ++ px) {
+          block[(py / 2) * blocks + px / 2] += rotated[py * parts_size + px];
+        }
+      }
+    }
+  }
+
+  return bound;
+}
+
+//////////////////////////////
+// 枝刈り用の下界の開放
+//////////////////////////////
+void free_bound(bound_t* const bound) {
+  if (bound == NULL) return;
+  free(bound->sum);
+  free(bound->norm);
+  free(bound->weight);
+  free(bound->block);
+  free(bound);
+}
+
+//////////////////////////////
+// 総和と二乗和による差異の下界(回転によらない)
+// コーシー・シュワルツの不等式から (Σa - Σb)^2 / n と (|a| - |b|)^2 はどちらも二乗誤差以下となる
+//////////////////////////////
+uint32_t bound_mean(bound_t const* const target_bound, int const target, bound_t const* const base_bound, int const base, int const pixels) {
+  int64_t const dist = (int64_t)target_bound->sum[target] - base_bound->sum[base];
+  uint64_t const mean = (uint64_t)(dist * dist) / pixels;
+  double const norm = target_bound->norm[target] - base_bound->norm[base];
+  // 浮動小数点の誤差で真の値を超えないよう 1 だけ小さくする
+  double const energy = norm * norm - 1.0;
+  uint64_t const value = (energy > (double)mean) ? (uint64_t)energy : mean;
+  return (value < UINT32_MAX) ? (uint32_t)value : UINT32_MAX;
+}
+
+//////////////////////////////
+// 2x2 ブロックの総和による差異の下界
+// ブロック内の画素数を c とすると (Σa - Σb)^2 / c はブロック内の二乗誤差以下となる
+// (4 / c を重みとして掛けてから最後に 4 で割る)
+//////////////////////////////
+uint32_t bound_lowres(bound_t const* const target_bound, int const target, bound_t const* const base_bound, int const base, int const rotation) {
+  int const stride = target_bound->stride;
+  int target_rotation = 0;
+  int base_rotation = rotation;
+  if (base_bound->rotations == 1) {
+    target_rotation = (ROTATION_SIZE - rotation) % ROTATION_SIZE;
+    base_rotation = 0;
+  }
+  uint16_t const* const a = &target_bound->block[((size_t)target * target_bound->rotations + target_rotation) * stride];
+  uint16_t const* const b = &base_bound->block[((size_t)base * base_bound->rotations + base_rotation) * stride];
+  return target_bound->lowres(a, b, target_bound->weight, stride) / 4;
+}
+
+//////////////////////////////
+// 打ち切り付きの差異(PRUNE_CHUNK 画素毎に計算し、途中で limit 以上になれば UINT32_MAX を返す)
+// ssd は PRUNE_CHUNK 画素用、rest は端数用の関数
+//////////////////////////////
+uint32_t diff_partial(image_t const* const target_image, int const target, image_t const* const base_image, position_t const* const position, ssd_func_t const ssd, ssd_func_t const rest, uint32_t const limit) {
+  uint8_t const* a;
+  uint8_t const* b;
+  if (base_image->rotations > 1) {
+    a = get_brightness(target_image, target, 0);
+    b = get_brightness(base_image, position->parts, position->rotation);
+  } else {
+    a = get_brightness(target_image, target, (ROTATION_SIZE - position->rotation) % ROTATION_SIZE);
+    b = get_brightness(base_image, position->parts, 0);
+  }
+  int const pixels = target_image->pixels;
+  uint32_t value = 0;
+  int p = 0;
+  for (; p + PRUNE_CHUNK <= pixels; p += PRUNE_CHUNK) {
+    value += ssd(&a[p], &b[p], PRUNE_CHUNK);
+    if (value >= limit && p + PRUNE_CHUNK < pixels) {
+      return UINT32_MAX;
+    }
+  }
+  if (p < pixels) {
+    value += rest(&a[p], &b[p], pixels - p);
+  }
+  return value;
+}
+
+//////////////////////////////
+// モザイクの並び替え
+// 未使用のベースパーツの添字を昇順に並べたリストを走査し、使用したものは詰めて取り除く。
+// 各ステップの探索はスレッド毎の最小値を集約する。差異が同じ場合はリストの前(添字が小さい)、
+// 回転が小さいものを選ぶため、スレッド数によらず逐次版と同じ結果になる。
+// コストがなく差異を直接計算する場合か、パーツ数が多い場合のみ並列化する
+//////////////////////////////
+int sort_mosaic(order_t const* const order, cost_t const* const cost, bound_t const* const shared_bound, image_t* const base_image, image_t* const target_image, mosaic_t* const mosaic, stats_t* const stats) {
+  // 未使用のベースパーツのリスト
+  int* active = (int*)malloc(sizeof(int) * base_image->size);
+  if (active == NULL) {
+    return -1;
+  }
+  int active_size = 0;
+  for (int b = 0; b < base_image->size; ++ b) {
+    if (!base_image->locked[b]) {
+      active[active_size ++] = b;
+    }
+  }
+
+  // コストがなければ枝刈り用の下界を用意する(ベース画像の下界は共有されていればそれを使う)
+  bound_t* owned_bound = NULL;
+  bound_t* target_bound = NULL;
+  if (cost == NULL) {
+    if (shared_bound == NULL) {
+      owned_bound = create_bound_by_image(base_image);
+    }
+    target_bound = create_bound_by_image(target_image);
+    if ((shared_bound == NULL && owned_bound == NULL) || target_bound == NULL) {
+      free_bound(target_bound);
+      free_bound(owned_bound);
+      free(active);
+      return -1;
+    }
+  }
+  bound_t const* const base_bound = (shared_bound != NULL) ? shared_bound : owned_bound;
+  ssd_func_t const ssd = select_ssd(PRUNE_CHUNK);
+  ssd_func_t const rest = select_ssd(0);
+
+  // 全スレッドの最小値
+  uint32_t best_value = UINT32_MAX;
+  int best_rotation = 0;
+  int best_index = 0;
+#if MOSAIC_STATS
+  double step_start = get_time();
+#endif
+
+  #pragma omp parallel if (cost == NULL || base_image->size >= SORT_PARALLEL_SIZE)
+  {
+    prune_t local_prune = { 0, 0, 0, 0, 0 };
+#if MOSAIC_STATS
+    stats_thread_t local_stats = { 0, 0, 0 };
+#endif
+    // 与えられた順番にパーツを探索(共有の状態は single の中でのみ更新する)
+    for (int i = 0; i < order->size && active_size > 0; ++ i) {
+      coord_t const coord = order->coord[i];
+      int const target = coord.y * target_image->width + coord.x;
+      // 重複していたら終了
+      if (target_image->locked[target]) {
+        #pragma omp single
+        printf("parts[%d][%d] is locked.\n", coord.y, coord.x);
+        break;
+      }
+      // 最も差分が小さいパーツを探索(コストがあれば計算済みの値を使う)
+      uint32_t local_value = UINT32_MAX;
+      int local_rotation = 0;
+      int local_index = 0;
+      if (cost != NULL) {
+        uint32_t const* const row = &cost->value[(size_t)target * cost->base_size * ROTATION_SIZE];
+        #pragma omp for schedule(static) nowait
+        for (int k = 0; k < active_size; ++ k) {
+          uint32_t const* const value = &row[active[k] * ROTATION_SIZE];
+#if MOSAIC_STATS
+          local_stats.candidate += ROTATION_SIZE;
+          local_stats.lookup += ROTATION_SIZE;
+#endif
+          for (int r = 0; r < ROTATION_SIZE; ++ r) {
+            if (value[r] < local_value) {
+              local_value = value[r];
+              local_rotation = r;
+              local_index = k;
+            }
+          }
+        }
+      } else {
+        // 下界が現在の最小値以上の候補は差異を計算せずに除く(同じ値では更新しないため結果は変わらない)
+        #pragma omp for schedule(static) nowait
+        for (int k = 0; k < active_size; ++ k) {
+          position_t position;
+          position.parts = active[k];
+          local_prune.candidate += ROTATION_SIZE;
+          if (bound_mean(target_bound, target, base_bound, position.parts, target_image->pixels) >= local_value) {
+            local_prune.mean += ROTATION_SIZE;
+            continue;
+          }
+          for (int r = 0; r < ROTATION_SIZE; ++ r) {
+            position.rotation = r;
+            if (bound_lowres(target_bound, target, base_bound, position.parts, r) >= local_value) {
+              ++ local_prune.lowres;
+              continue;
+            }
+            uint32_t const value = diff_partial(target_image, target, base_image, &position, ssd, rest, local_value);
+            if (value == UINT32_MAX) {
+              ++ local_prune.partial;
+              continue;
+            }
+            ++ local_prune.full;
+            if (value < local_value) {
+              local_value = value;
+              local_rotation = r;
+              local_index = k;
+            }
+          }
+        }
+      }
+      // スレッド毎の最小値を集約する
+      #pragma omp critical
+      {
+        if (local_value < best_value ||
+            (local_value == best_value && (local_index < best_index ||
+                                           (local_index == best_index && local_rotation < best_rotation)))) {
+          best_value = local_value;
+          best_rotation = local_rotation;
+          best_index = local_index;
+        }
+      }
+      #pragma omp barrier
+      // パーツを確定する
+      #pragma omp single
+      {
+        int const best_parts = active[best_index];
+#if MOSAIC_STATS
+        if (stats != NULL) {
+          double const now = get_time();
+          record_step(stats, target, best_value, now - step_start);
+          stats->locked += base_image->size - active_size;
+          step_start = now;
+        }
+#endif
+        position_t position;
+        position.rotation = best_rotation;
+        position.parts = best_parts;
+        mosaic->position[target] = position;
+        base_image->locked[best_parts] = true;
+        target_image->locked[target] = true;
+        memmove(&active[best_index], &active[best_index + 1], sizeof(int) * (active_size - best_index - 1));
+        -- active_size;
+        best_value = UINT32_MAX;
+        best_rotation = 0;
+        best_index = 0;
+      }
+    }
+    // 枝刈りの件数を集約する
+    if (stats != NULL) {
+      #pragma omp critical
+      {
+        stats->prune.candidate += local_prune.candidate;
+        stats->prune.mean += local_prune.mean;
+        stats->prune.lowres += local_prune.lowres;
+        stats->prune.partial += local_prune.partial;
+        stats->prune.full += local_prune.full;
+      }
+#if MOSAIC_STATS
+      // スレッド毎の件数(直接計算した場合の件数は枝刈りの件数から求める)
+#ifdef _OPENMP
+      int const thread = omp_get_thread_num();
+      int const threads = omp_get_num_threads();
+#else
+      int const thread = 0;
+      int const threads = 1;
+#endif
+      if (thread < STATS_THREADS) {
+        stats_thread_t* const dst = &stats->thread[thread];
+        dst->candidate += local_stats.candidate + local_prune.candidate;
+        dst->lookup += local_stats.lookup;
+        dst->diff += local_prune.partial + local_prune.full;
+      }
+      #pragma omp single nowait
+      stats->threads = (threads < STATS_THREADS) ? threads : STATS_THREADS;
+#endif
+    }
+  }
+
+  free_bound(target_bound);
+  free_bound(owned_bound);
+  free(active);
+  return 0;
+}
+
+//////////////////////////////
+// 線形割当問題を解く(ハンガリアン法, O(n^3))
+// assign[対象パーツ] = ベースパーツ
+//////////////////////////////
+int solve_lap(min_cost_t const* const min_cost, int* const assign) {
+  int const n = min_cost->size;
+  int64_t const inf = INT64_MAX / 2;
+
+  // メモリ確保(添字 0 は番兵)
+  int64_t* u = (int64_t*)malloc(sizeof(int64_t) * (n + 1));
+  int64_t* v = (int64_t*)malloc(sizeof(int64_t) * (n + 1));
+  int64_t* minv = (int64_t*)malloc(sizeof(int64_t) * (n + 1));
+  int* p = (int*)malloc(sizeof(int) * (n + 1));
+  int* way = (int*)malloc(sizeof(int) * (n + 1));
+  bool* used = (bool*)malloc(sizeof(bool) * (n + 1));
+  if (u == NULL || v == NULL || minv == NULL || p == NULL || way == NULL || used == NULL) {
+    free(u);
+    free(v);
+    free(minv);
+    free(p);
+    free(way);
+    free(used);
+    return -1;
+  }
+  for (int j = 0; j <= n; ++ j) {
+    u[j] = 0;
+    v[j] = 0;
+    p[j] = 0;
+    way[j] = 0;
+  }
+
+  // 対象パーツを 1 つずつ追加し、最短増加路で割当を更新する
+  for (int i = 1; i <= n; ++ i) {
+    p[0] = i;
+    int j0 = 0;
+    for (int j = 0; j <= n; ++ j) {
+      minv[j] = inf;
+      used[j] = false;
+    }
+    do {
+      used[j0] = true;
+      int const i0 = p[j0];
+      uint32_t const* const row = &min_cost->value[(size_t)(i0 - 1) * n];
+      int64_t delta = inf;
+      int j1 = 0;
+      for (int j = 1; j <= n; ++ j) {
+        if (used[j]) continue;
+        int64_t const cur = (int64_t)row[j - 1] - u[i0] - v[j];
+        if (cur < minv[j]) {
+          minv[j] = cur;
+          way[j] = j0;
+        }
+        if (minv[j] < delta) {
+          delta = minv[j];
+          j1 = j;
+        }
+      }
+      for (int j = 0; j <= n; ++ j) {
+        if (used[j]) {
+          u[p[j]] += delta;
+          v[j] -= delta;
+        } else {
+          minv[j] -= delta;
+        }
+      }
+      j0 = j1;
+    } while (p[j0] != 0);
+    do {
+      int const j1 = way[j0];
+      p[j0] = p[j1];
+      j0 = j1;
+    } while (j0 != 0);
+  }
+
+  for (int j = 1; j <= n; ++ j) {
+    assign[p[j] - 1] = j - 1;
+  }
+
+  free(u);
+  free(v);
+  free(minv);
+  free(p);
+  free(way);
+  free(used);
+  return 0;
+}
+
+//////////////////////////////
+// 線形割当問題を解く(ε スケーリング付きオークション法)
+// 入札は全ての未割当パーツが同時に行い(ヤコビ型)、OpenMP で並列化する。
+// コストを (n + 1) 倍して最終的に ε = 1 まで下げるため、結果は最適解と一致する。
+//////////////////////////////
+int solve_auction(min_cost_t const* const min_cost, int* const assign) {
+  int const n = min_cost->size;
+  if (n == 1) {
+    assign[0] = 0;
+    return 0;
+  }
+
+  // メモリ確保
+  int64_t* price = (int64_t*)malloc(sizeof(int64_t) * n);
+  int64_t* bid_price = (int64_t*)malloc(sizeof(int64_t) * n);
+  int64_t* best_price = (int64_t*)malloc(sizeof(int64_t) * n);
+  int* bid_object = (int*)malloc(sizeof(int) * n);
+  int* best_bidder = (int*)malloc(sizeof(int) * n);
+  int* owner = (int*)malloc(sizeof(int) * n);
+  int* queue = (int*)malloc(sizeof(int) * n);
+  int* next_queue = (int*)malloc(sizeof(int) * n);
+  if (price == NULL || bid_price == NULL || best_price == NULL || bid_object == NULL ||
+      best_bidder == NULL || owner == NULL || queue == NULL || next_queue == NULL) {
+    free(price);
+    free(bid_price);
+    free(best_price);
+    free(bid_object);
+    free(best_bidder);
+    free(owner);
+    free(queue);
+    free(next_queue);
+    return -1;
+  }
+
+  // ε の初期値は最大コストから決める
+  int64_t const scale = n + 1;
+  uint32_t max_value = 0;
+  for (size_t i = 0; i < (size_t)n * n; ++ i) {
+    if (min_cost->value[i] > max_value) {
+      max_value = min_cost->value[i];
+    }
+  }
+  int64_t eps = (int64_t)max_value * scale / 2;
+  if (eps < 1) eps = 1;
+  for (int j = 0; j < n; ++ j) {
+    price[j] = 0;
+    best_bidder[j] = -1;
+  }
+
+  for (;;) {
+    // 価格を引き継いで割当をやり直す
+    for (int j = 0; j < n; ++ j) {
+      owner[j] = -1;
+    }
+    int count = n;
+    for (int i = 0; i < n; ++ i) {
+      assign[i] = -1;
+      queue[i] = i;
+    }
+
+    while (count > 0) {
+      // 入札: 最良と次点の利得の差 + ε だけ価格を上げる
+      #pragma omp parallel for schedule(static)
+      for (int k = 0; k < count; ++ k) {
+        int const i = queue[k];
+        uint32_t const* const row = &min_cost->value[(size_t)i * n];
+        int64_t best = INT64_MIN;
+        int64_t second = INT64_MIN;
+        int best_j = 0;
+        for (int j = 0; j < n; ++ j) {
+          int64_t const profit = -(int64_t)row[j] * scale - price[j];
+          if (profit > best) {
+            second = best;
+            best = profit;
+            best_j = j;
+          } else if (profit > second) {
+            second = profit;
+          }
+        }
+        bid_object[k] = best_j;
+        bid_price[k] = price[best_j] + (best - second) + eps;
+      }
+
+      // 落札: 対象毎に最高値(同値なら番号の小さいパーツ)を選ぶ
+      for (int k = 0; k < count; ++ k) {
+        int const j = bid_object[k];
+        int const i = queue[k];
+        if (best_bidder[j] < 0 || bid_price[k] > best_price[j] ||
+            (bid_price[k] == best_price[j] && i < best_bidder[j])) {
+          best_bidder[j] = i;
+          best_price[j] = bid_price[k];
+        }
+      }
+      int next_count = 0;
+      for (int k = 0; k < count; ++ k) {
+        int const j = bid_object[k];
+        int const i = queue[k];
+        if (best_bidder[j] != i) {
+          next_queue[next_count ++] = i;
+          continue;
+        }
+        // 元の所有者は未割当に戻る
+        if (owner[j] >= 0) {
+          assign[owner[j]] = -1;
+          next_queue[next_count ++] = owner[j];
+        }
+        owner[j] = i;
+        assign[i] = j;
+        price[j] = best_price[j];
+        best_bidder[j] = -1;
+      }
+
+      int* const tmp = queue;
+      queue = next_queue;
+      next_queue = tmp;
+      count = next_count;
+    }
+
+    if (eps == 1) break;
+    eps /= AUCTION_SCALING;
+    if (eps < 1) eps = 1;
+  }
+
+  free(price);
+  free(bid_price);
+  free(best_price);
+  free(bid_object);
+  free(best_bidder);
+  free(owner);
+  free(queue);
+  free(next_queue);
+  return 0;
+}
+
+//////////////////////////////
+// 組み合わせの比較(差異、対象パーツ、ベースパーツの昇順)
+//////////////////////////////
+int compare_pair(void const* const a, void const* const b) {
+  pair_t const* const pa = (pair_t const*)a;
+  pair_t const* const pb = (pair_t const*)b;
+  if (pa->value != pb->value) return pa->value < pb->value ? -1 : 1;
+  if (pa->target != pb->target) return pa->target < pb->target ? -1 : 1;
+  if (pa->base != pb->base) return pa->base < pb->base ? -1 : 1;
+  return 0;
+}
+
+//////////////////////////////
+// 全体で差異が最小の組み合わせから順に割り当てる(貪欲法)
+// 全ての組み合わせを差異の昇順に並べて先頭から取り出し、
+// 対象パーツかベースパーツが割当済みのものは読み飛ばす(遅延削除)
+//////////////////////////////
+int solve_pq(min_cost_t const* const min_cost, int* const assign) {
+  int const n = min_cost->size;
+  size_t const count = (size_t)n * n;
+  pair_t* pair = (pair_t*)malloc(sizeof(pair_t) * count);
+  bool* used = (bool*)calloc(n, sizeof(bool));
+  if (pair == NULL || used == NULL) {
+    free(used);
+    free(pair);
+    return -1;
+  }
+  for (int t = 0; t < n; ++ t) {
+    assign[t] = -1;
+    for (int b = 0; b < n; ++ b) {
+      pair_t* const p = &pair[(size_t)t * n + b];
+      p->value = min_cost->value[(size_t)t * n + b];
+      p->target = t;
+      p->base = b;
+    }
+  }
+  qsort(pair, count, sizeof(pair_t), compare_pair);
+
+  int assigned = 0;
+  for (size_t k = 0; k < count && assigned < n; ++ k) {
+    pair_t const* const p = &pair[k];
+    if (assign[p->target] >= 0 || used[p->base]) continue;
+    assign[p->target] = p->base;
+    used[p->base] = true;
+    ++ assigned;
+  }
+
+  free(used);
+  free(pair);
+  return 0;
+}
+
+//////////////////////////////
+// モザイクの並び替え(線形割当)
+//////////////////////////////
+int sort_mosaic_by_assign(assign_func_t const solve, cost_t const* const cost, image_t* const base_image, image_t* const target_image, mosaic_t* const mosaic) {
+  // 回転毎の最小値を抽出
+  min_cost_t* min_cost = create_min_cost_by_cost(cost);
+  if (min_cost == NULL) {
+    return -1;
+  }
+  int const n = min_cost->size;
+  int* assign = (int*)malloc(sizeof(int) * n);
+  if (assign == NULL) {
+    free_min_cost(min_cost);
+    return -1;
+  }
+
+  // 割当を解く
+  if (solve(min_cost, assign) < 0) {
+    free(assign);
+    free_min_cost(min_cost);
+    return -1;
+  }
+
+  // パーツを確定する
+  for (int t = 0; t < n; ++ t) {
+    int const b = assign[t];
+    position_t position;
+    position.rotation = min_cost->rotation[(size_t)t * n + b];
+    position.parts = b;
+    mosaic->position[t] = position;
+    base_image->locked[b] = true;
+    target_image->locked[t] = true;
+  }
+
+  free(assign);
+  free_min_cost(min_cost);
+  return 0;
+}
+
+//////////////////////////////
+// 線形割当の最適解における差異の総和
+//////////////////////////////
+int evaluate_lap(cost_t const* const cost, uint64_t* const value) {
+  min_cost_t* min_cost = create_min_cost_by_cost(cost);
+  if (min_cost == NULL) {
+    return -1;
+  }
+  int const n = min_cost->size;
+  int* assign = (int*)malloc(sizeof(int) * n);
+  if (assign == NULL) {
+    free_min_cost(min_cost);
+    return -1;
+  }
+  if (solve_lap(min_cost, assign) < 0) {
+    free(assign);
+    free_min_cost(min_cost);
+    return -1;
+  }
+  uint64_t sum = 0;
+  for (int t = 0; t < n; ++ t) {
+    sum += min_cost->value[(size_t)t * n + assign[t]];
+  }
+  *value = sum;
+  free(assign);
+  free_min_cost(min_cost);
+  return 0;
+}
+
+//////////////////////////////
+// モザイクと対象画像の差異の総和
+//////////////////////////////
+uint64_t evaluate_mosaic(mosaic_t const* const mosaic, image_t const* const target_image) {
+  uint64_t sum = 0;
+  for (int t = 0; t < target_image->size; ++ t) {
+    sum += diff(target_image, t, mosaic->image, &mosaic->position[t]);
+  }
+  return sum;
+}
+
+//////////////////////////////
+// モザイクの差異の総和をコストオブジェクトから求める
+//////////////////////////////
+uint64_t evaluate_mosaic_by_cost(mosaic_t const* const mosaic, cost_t const* const cost) {
+  uint64_t sum = 0;
+  for (int t = 0; t < cost->target_size; ++ t) {
+    position_t const* const position = &mosaic->position[t];
+    sum += cost->value[((size_t)t * cost->base_size + position->parts) * ROTATION_SIZE + position->rotation];
+  }
+  return sum;
+}
+
+//////////////////////////////
+// 経過時間(秒)
+//////////////////////////////
+double get_time() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+//////////////////////////////
+// 局所探索によるモザイクの改善
+// 2 箇所のベースパーツの交換と 3 箇所の巡回を、差異の総和が減る限り繰り返す。
+// 回転は常にパーツの組み合わせ毎の最良のものを使う。
+// 戻り値は採用した移動の回数
+//////////////////////////////
+int refine_mosaic(cost_t const* const cost, mosaic_t* const mosaic, int const time_limit) {
+  min_cost_t* min_cost = create_min_cost_by_cost(cost);
+  if (min_cost == NULL) {
+    return -1;
+  }
+  int const n = min_cost->size;
+  int* assign = (int*)malloc(sizeof(int) * n);
+  if (assign == NULL) {
+    free_min_cost(min_cost);
+    return -1;
+  }
+  for (int t = 0; t < n; ++ t) {
+    assign[t] = mosaic->position[t].parts;
+  }
+
+  uint32_t const* const value = min_cost->value;
+  double const deadline = get_time() + time_limit / 1000.0;
+  int moves = 0;
+  bool improved = true;
+  while (improved && get_time() < deadline) {
+    improved = false;
+
+    // 2 箇所の交換
+    for (int i = 0; i < n && get_time() < deadline; ++ i) {
+      uint32_t const* const vi = &value[(size_t)i * n];
+      for (int j = i + 1; j < n; ++ j) {
+        uint32_t const* const vj = &value[(size_t)j * n];
+        int64_t const delta = (int64_t)vi[assign[j]] + vj[assign[i]] - vi[assign[i]] - vj[assign[j]];
+        if (delta < 0) {
+          int const tmp = assign[i];
+          assign[i] = assign[j];
+          assign[j] = tmp;
+          ++ moves;
+          improved = true;
+        }
+      }
+    }
+    if (improved) continue;
+
+    // 3 箇所の巡回(i <- j, j <- k, k <- i)
+    // 改善する巡回には必ず改善する箇所があるため、i が改善する組み合わせから探す
+    for (int i = 0; i < n && get_time() < deadline; ++ i) {
+      uint32_t const* const vi = &value[(size_t)i * n];
+      bool found = false;
+      for (int j = 0; j < n && !found; ++ j) {
+        int64_t const di = (int64_t)vi[assign[j]] - vi[assign[i]];
+        if (j == i || di >= 0) continue;
+        uint32_t const* const vj = &value[(size_t)j * n];
+        for (int k = 0; k < n; ++ k) {
+          if (k == i || k == j) continue;
+          uint32_t const* const vk = &value[(size_t)k * n];
+          int64_t const delta = di + vj[assign[k]] - vj[assign[j]] + vk[assign[i]] - vk[assign[k]];
+          if (delta < 0) {
+            int const tmp = assign[i];
+            assign[i] = assign[j];
+            assign[j] = assign[k];
+            assign[k] = tmp;
+            ++ moves;
+            improved = true;
+            found = true;
+            break;
+          }
+        }
+      }
+    }
+  }
+
+  // モザイクに反映する
+  for (int t = 0; t < n; ++ t) {
+    position_t* const position = &mosaic->position[t];
+    position->parts = assign[t];
+    position->rotation = min_cost->rotation[(size_t)t * n + assign[t]];
+  }
+
+  free(assign);
+  free_min_cost(min_cost);
+  return moves;
+}
+
+//////////////////////////////
+// 境界の評価オブジェクトの生成
+//////////////////////////////
+seam_t* create_seam_by_image(cost_t const* const cost, image_t const* const base_image, int const weight) {
+  // メモリ確保
+  seam_t* seam = (seam_t*)malloc(sizeof(seam_t));
+  if (seam == NULL) {
+    return NULL;
+  }
+  int const size = base_image->size;
+  int const parts_size = base_image->parts_size;
+  seam->cost = cost;
+  seam->weight = weight;
+  seam->height = base_image->height;
+  seam->width = base_image->width;
+  seam->parts_size = parts_size;
+  seam->ssd = select_ssd(parts_size);
+  seam->edge = (uint8_t*)malloc(sizeof(uint8_t) * size * ROTATION_SIZE * 4 * parts_size);
+  if (seam->edge == NULL) {
+    free(seam);
+    return NULL;
+  }
+
+  // 回転毎に上右下左の境界の画素を抜き出す(上下は左から右、左右は上から下の順)
+  uint8_t* const buffer = (uint8_t*)malloc(sizeof(uint8_t) * base_image->pixels);
+  if (buffer == NULL) {
+    free_seam(seam);
+    return NULL;
+  }
+  for (int b = 0; b < size; ++ b) {
+    for (int r = 0; r < ROTATION_SIZE; ++ r) {
+      uint8_t const* const data = get_rotated_brightness(base_image, b, r, buffer);
+      uint8_t* const edge = &seam->edge[(b * ROTATION_SIZE + r) * 4 * parts_size];
+      for (int p = 0; p < parts_size; ++ p) {
+        edge[0 * parts_size + p] = data[p];
+        edge[1 * parts_size + p] = data[p * parts_size + parts_size - 1];
+        edge[2 * parts_size + p] = data[(parts_size - 1) * parts_size + p];
+        edge[3 * parts_size + p] = data[p * parts_size];
+      }
+    }
+  }
+  free(buffer);
+
+  return seam;
+}
+
+//////////////////////////////
+// 境界の評価オブジェクトの開放
+//////////////////////////////
+void free_seam(seam_t* const seam) {
+  if (seam == NULL) return;
+  free(seam->edge);
+  free(seam);
+}
+
+//////////////////////////////
+// 1 箇所の評価値(対象パーツとの差異 + 隣接パーツとの境界の差異)
+// skip に指定した位置との境界は数えない
+//////////////////////////////
+int64_t seam_energy(seam_t const* const seam, int const* const assign, uint8_t const* const rotation, int const i, int const skip) {
+  int const width = seam->width;
+  int const parts_size = seam->parts_size;
+  int const x = i % width;
+  int const y = i / width;
+  int const base_size = seam->cost->base_size;
+  uint8_t const* const edge = &seam->edge[(assign[i] * ROTATION_SIZE + rotation[i]) * 4 * parts_size];
+  int64_t sum = seam->cost->value[((size_t)i * base_size + assign[i]) * ROTATION_SIZE + rotation[i]];
+  if (seam->weight == 0) return sum;
+
+  int64_t border = 0;
+  if (x > 0 && i - 1 != skip) {
+    uint8_t const* const other = &seam->edge[(assign[i - 1] * ROTATION_SIZE + rotation[i - 1]) * 4 * parts_size];
+    border += seam->ssd(&other[1 * parts_size], &edge[3 * parts_size], parts_size);
+  }
+  if (x < width - 1 && i + 1 != skip) {
+    uint8_t const* const other = &seam->edge[(assign[i + 1] * ROTATION_SIZE + rotation[i + 1]) * 4 * parts_size];
+    border += seam->ssd(&edge[1 * parts_size], &other[3 * parts_size], parts_size);
+  }
+  if (y > 0 && i - width != skip) {
+    uint8_t const* const other = &seam->edge[(assign[i - width] * ROTATION_SIZE + rotation[i - width]) * 4 * parts_size];
+    border += seam->ssd(&other[2 * parts_size], &edge[0 * parts_size], parts_size);
+  }
+  if (y < seam->height - 1 && i + width != skip) {
+    uint8_t const* const other = &seam->edge[(assign[i + width] * ROTATION_SIZE + rotation[i + width]) * 4 * parts_size];
+    border += seam->ssd(&edge[2 * parts_size], &other[0 * parts_size], parts_size);
+  }
+  return sum + border * seam->weight;
+}
+
+//////////////////////////////
+// 配置全体の評価値(境界は両側のパーツから数えた後に半分にして重複を除く)
+//////////////////////////////
+int64_t total_energy(seam_t const* const seam, int const* const assign, uint8_t const* const rotation) {
+  int const size = seam->height * seam->width;
+  int64_t sum = 0;
+  for (int i = 0; i < size; ++ i) {
+    sum += seam_energy(seam, assign, rotation, i, -1);
+  }
+  // 境界は両側から数えているため半分にする
+  int64_t target = 0;
+  for (int i = 0; i < size; ++ i) {
+    target += seam->cost->value[((size_t)i * seam->cost->base_size + assign[i]) * ROTATION_SIZE + rotation[i]];
+  }
+  return target + (sum - target) / 2;
+}
+
+//////////////////////////////
+// 乱数(xorshift64*)
+//////////////////////////////
+uint64_t next_random(uint64_t* const seed) {
+  uint64_t x = *seed;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *seed = x;
+  return x * 0x2545F4914F6CDD1DULL;
+}
+
+//////////////////////////////
+// 1 つのレプリカを指定した温度で焼きなます
+// 移動は 2 箇所の交換(回転ごと)と 1 箇所の回転の変更
+//////////////////////////////
+void anneal_replica(seam_t const* const seam, replica_t* const replica, double const temperature, int const steps) {
+  int const size = seam->height * seam->width;
+  int* const assign = replica->assign;
+  uint8_t* const rotation = replica->rotation;
+  for (int step = 0; step < steps; ++ step) {
+    uint64_t const random = next_random(&replica->seed);
+    int const i = (int)((random >> 32) % size);
+    bool const swap = (random & 1) == 0;
+    int j = -1;
+    int64_t before = 0;
+    int64_t after = 0;
+    int old_rotation = rotation[i];
+    if (swap) {
+      j = (int)((random >> 8 & 0xFFFFFF) % size);
+      if (i == j) continue;
+      before = seam_energy(seam, assign, rotation, i, -1) + seam_energy(seam, assign, rotation, j, i);
+      int const tmp_assign = assign[i];
+      assign[i] = assign[j];
+      assign[j] = tmp_assign;
+      uint8_t const tmp_rotation = rotation[i];
+      rotation[i] = rotation[j];
+      rotation[j] = tmp_rotation;
+      after = seam_energy(seam, assign, rotation, i, -1) + seam_energy(seam, assign, rotation, j, i);
+    } else {
+      before = seam_energy(seam, assign, rotation, i, -1);
+      rotation[i] = (uint8_t)((old_rotation + 1 + (random >> 8) % (ROTATION_SIZE - 1)) % ROTATION_SIZE);
+      after = seam_energy(seam, assign, rotation, i, -1);
+    }
+
+    // メトロポリス判定
+    int64_t const delta = after - before;
+    bool accept = delta <= 0;
+    if (!accept) {
+      double const u = (next_random(&replica->seed) >> 11) * (1.0 / 9007199254740992.0);
+      accept = u < exp(-delta / temperature);
+    }
+    if (!accept) {
+      if (swap) {
+        int const tmp_assign = assign[i];
+        assign[i] = assign[j];
+        assign[j] = tmp_assign;
+        uint8_t const tmp_rotation = rotation[i];
+        rotation[i] = rotation[j];
+        rotation[j] = tmp_rotation;
+      } else {
+        rotation[i] = (uint8_t)old_rotation;
+      }
+      continue;
+    }
+    replica->energy += delta;
+    if (replica->energy < replica->best_energy) {
+      replica->best_energy = replica->energy;
+      memcpy(replica->best_assign, assign, sizeof(int) * size);
+      memcpy(replica->best_rotation, rotation, sizeof(uint8_t) * size);
+    }
+  }
+}
+
+//////////////////////////////
+// 焼きなましによるモザイクの改善(レプリカ交換法)
+// 評価値は対象パーツとの差異に、隣接パーツの境界の差異を重み付きで加えたもの。
+// レプリカ毎に温度を変えて並列に焼きなまし、ラウンド毎に隣の温度と状態を交換する
+//////////////////////////////
+int anneal_mosaic(cost_t const* const cost, image_t const* const base_image, mosaic_t* const mosaic, int const rounds, int const replicas, int const weight, int64_t* const before, int64_t* const after) {
+  int const size = base_image->size;
+  seam_t* seam = create_seam_by_image(cost, base_image, weight);
+  replica_t* replica = (replica_t*)calloc(replicas, sizeof(replica_t));
+  double* temperature = (double*)malloc(sizeof(double) * replicas);
+  bool error = seam == NULL || replica == NULL || temperature == NULL;
+  for (int k = 0; !error && k < replicas; ++ k) {
+    replica[k].assign = (int*)malloc(sizeof(int) * size);
+    replica[k].rotation = (uint8_t*)malloc(sizeof(uint8_t) * size);
+    replica[k].best_assign = (int*)malloc(sizeof(int) * size);
+    replica[k].best_rotation = (uint8_t*)malloc(sizeof(uint8_t) * size);
+    error = replica[k].assign == NULL || replica[k].rotation == NULL ||
+            replica[k].best_assign == NULL || replica[k].best_rotation == NULL;
+  }
+
+  if (!error) {
+    // 初期状態は全レプリカとも現在のモザイク
+    for (int t = 0; t < size; ++ t) {
+      position_t const* const position = &mosaic->position[t];
+      replica[0].assign[t] = position->parts;
+      replica[0].rotation[t] = (uint8_t)position->rotation;
+    }
+    int64_t const energy = total_energy(seam, replica[0].assign, replica[0].rotation);
+    for (int k = 0; k < replicas; ++ k) {
+      memcpy(replica[k].assign, replica[0].assign, sizeof(int) * size);
+      memcpy(replica[k].rotation, replica[0].rotation, sizeof(uint8_t) * size);
+      memcpy(replica[k].best_assign, replica[0].assign, sizeof(int) * size);
+      memcpy(replica[k].best_rotation, replica[0].rotation, sizeof(uint8_t) * size);
+      replica[k].energy = energy;
+      replica[k].best_energy = energy;
+      replica[k].seed = 0x9E3779B97F4A7C15ULL * (k + 1);
+    }
+    *before = energy;
+
+    // 温度は 1 箇所あたりの評価値を基準に等比で配置する
+    double const scale = (double)energy / size;
+    for (int k = 0; k < replicas; ++ k) {
+      double const ratio = (replicas > 1) ? (double)k / (replicas - 1) : 0.0;
+      temperature[k] = scale * ANNEAL_T_MIN * pow(ANNEAL_T_MAX / ANNEAL_T_MIN, ratio);
+    }
+
+    uint64_t seed = 0x2545F4914F6CDD1DULL;
+    for (int round = 0; round < rounds; ++ round) {
+      #pragma omp parallel for schedule(static, 1)
+      for (int k = 0; k < replicas; ++ k) {
+        anneal_replica(seam, &replica[k], temperature[k], ANNEAL_STEPS * size);
+      }
+      // 隣り合う温度のレプリカで状態を交換する
+      for (int k = round % 2; k + 1 < replicas; k += 2) {
+        double const exponent = (replica[k].energy - replica[k + 1].energy) * (1.0 / temperature[k] - 1.0 / temperature[k + 1]);
+        double const u = (next_random(&seed) >> 11) * (1.0 / 9007199254740992.0);
+        if (exponent >= 0 || u < exp(exponent)) {
+          replica_t const tmp = replica[k];
+          replica[k] = replica[k + 1];
+          replica[k + 1] = tmp;
+        }
+      }
+    }
+
+    // 最良のレプリカをモザイクに反映する
+    int best = 0;
+    for (int k = 1; k < replicas; ++ k) {
+      if (replica[k].best_energy < replica[best].best_energy) {
+        best = k;
+      }
+    }
+    for (int t = 0; t < size; ++ t) {
+      position_t* const position = &mosaic->position[t];
+      position->parts = replica[best].best_assign[t];
+      position->rotation = replica[best].best_rotation[t];
+    }
+    *after = replica[best].best_energy;
+  }
+
+  for (int k = 0; replica != NULL && k < replicas; ++ k) {
+    free(replica[k].assign);
+    free(replica[k].rotation);
+    free(replica[k].best_assign);
+    free(replica[k].best_rotation);
+  }
+  free(temperature);
+  free(replica);
+  free_seam(seam);
+  return error ? -1 : 0;
+}
+
+//////////////////////////////
+// パーツの特徴量(ANN_BLOCK x ANN_BLOCK のブロック毎の画素値の平均)
+//////////////////////////////
+void create_feature(uint8_t const* const data, int const parts_size, float* const feature) {
+  for (int by = 0; by < ANN_BLOCK; ++ by) {
+    int const y0 = by * parts_size / ANN_BLOCK;
+    int const y1 = (by + 1) * parts_size / ANN_BLOCK;
+    for (int bx = 0; bx < ANN_BLOCK; ++ bx) {
+      int const x0 = bx * parts_size / ANN_BLOCK;
+      int const x1 = (bx + 1) * parts_size / ANN_BLOCK;
+      int sum = 0;
+      for (int py = y0; py < y1; ++ py) {
+        for (int px = x0; px < x1; ++ px) {
+          sum += data[py * parts_size + px];
+        }
+      }
+      int const count = (y1 - y0) * (x1 - x0);
+      feature[by * ANN_BLOCK + bx] = (count > 0) ? (float)sum / count : 0.0f;
+    }
+  }
+}
+
+//////////////////////////////
+// 特徴量を主成分に射影
+//////////////////////////////
+void project_feature(index_t const* const index, float const* const feature, float* const dst) {
+  for (int d = 0; d < ANN_DIM; ++ d) {
+    float const* const basis = &index->basis[d * ANN_FEATURE];
+    float sum = 0.0f;
+    for (int f = 0; f < ANN_FEATURE; ++ f) {
+      sum += (feature[f] - index->mean[f]) * basis[f];
+    }
+    dst[d] = sum;
+  }
+}
+
+//////////////////////////////
+// 射影した特徴量同士の距離(二乗)
+//////////////////////////////
+float distance_feature(float const* const a, float const* const b) {
+  float sum = 0.0f;
+  for (int d = 0; d < ANN_DIM; ++ d) {
+    float const dist = a[d] - b[d];
+    sum += dist * dist;
+  }
+  return sum;
+}
+
+//////////////////////////////
+// 対称行列の固有値分解(ヤコビ法)
+// a は対角化され、v の各行に固有ベクトルが入る
+//////////////////////////////
+void solve_eigen(double* const a, double* const v, int const n) {
+  for (int i = 0; i < n; ++ i) {
+    for (int j = 0; j < n; ++ j) {
+      v[i * n + j] = (i == j) ? 1.0 : 0.0;
+    }
+  }
+  for (int sweep = 0; sweep < 50; ++ sweep) {
+    double off = 0.0;
+    for (int i = 0; i < n; ++ i) {
+      for (int j = i + 1; j < n; ++ j) {
+        off += a[i * n + j] * a[i * n + j];
+      }
+    }
+    if (off < 1e-12) break;
+    for (int p = 0; p < n; ++ p) {
+      for (int q = p + 1; q < n; ++ q) {
+        double const apq = a[p * n + q];
+        if (fabs(apq) < 1e-15) continue;
+        double const theta = (a[q * n + q] - a[p * n + p]) / (2.0 * apq);
+        double const t = ((theta >= 0) ? 1.0 : -1.0) / (fabs(theta) + sqrt(theta * theta + 1.0));
+        double const c = 1.0 / sqrt(t * t + 1.0);
+        double const s = t * c;
+        for (int k = 0; k < n; ++ k) {
+          double const akp = a[k * n + p];
+          double const akq = a[k * n + q];
+          a[k * n + p] = c * akp - s * akq;
+          a[k * n + q] = s * akp + c * akq;
+        }
+        for (int k = 0; k < n; ++ k) {
+          double const apk = a[p * n + k];
+          double const aqk = a[q * n + k];
+          a[p * n + k] = c * apk - s * aqk;
+          a[q * n + k] = s * apk + c * aqk;
+        }
+        for (int k = 0; k < n; ++ k) {
+          double const vpk = v[p * n + k];
+          double const vqk = v[q * n + k];
+          v[p * n + k] = c * vpk - s * vqk;
+          v[q * n + k] = s * vpk + c * vqk;
+        }
+      }
+    }
+  }
+}
+
+//////////////////////////////
+// ベース画像から近傍探索の索引を生成
+// 特徴量を主成分分析で ANN_DIM 次元に落とし、k-means でクラスタ毎のリストに分ける(IVF)。
+// k-means の学習は最大 ANN_TRAIN 個の標本で行い、全パーツは最後に 1 回だけ割り当てる
+//////////////////////////////
+index_t* create_index_by_image(image_t const* const image) {
+  int const size = image->size;
+  int const list_count = (int)sqrt((double)size) > 0 ? (int)sqrt((double)size) : 1;
+
+  // メモリ確保
+  index_t* index = (index_t*)calloc(1, sizeof(index_t));
+  if (index == NULL) {
+    return NULL;
+  }
+  index->size = size;
+  index->list_count = list_count;
+  index->mean = (float*)malloc(sizeof(float) * ANN_FEATURE);
+  index->basis = (float*)malloc(sizeof(float) * ANN_DIM * ANN_FEATURE);
+  index->feature = (float*)malloc(sizeof(float) * size * ANN_DIM);
+  index->centroid = (float*)malloc(sizeof(float) * list_count * ANN_DIM);
+  index->list = (int*)malloc(sizeof(int) * size);
+  index->list_begin = (int*)malloc(sizeof(int) * (list_count + 1));
+  index->list_size = (int*)malloc(sizeof(int) * list_count);
+  index->slot = (int*)malloc(sizeof(int) * size);
+  index->cluster = (int*)malloc(sizeof(int) * size);
+  float* raw = (float*)malloc(sizeof(float) * size * ANN_FEATURE);
+  if (index->mean == NULL || index->basis == NULL || index->feature == NULL || index->centroid == NULL ||
+      index->list == NULL || index->list_begin == NULL || index->list_size == NULL ||
+      index->slot == NULL || index->cluster == NULL || raw == NULL) {
+    free(raw);
+    free_index(index);
+    return NULL;
+  }
+
+  // 特徴量と平均
+  #pragma omp parallel for schedule(static)
+  for (int i = 0; i < size; ++ i) {
+    create_feature(get_brightness(image, i, 0), image->parts_size, &raw[(size_t)i * ANN_FEATURE]);
+  }
+  double mean[ANN_FEATURE] = { 0.0 };
+  for (int i = 0; i < size; ++ i) {
+    for (int f = 0; f < ANN_FEATURE; ++ f) {
+      mean[f] += raw[(size_t)i * ANN_FEATURE + f];
+    }
+  }
+  for (int f = 0; f < ANN_FEATURE; ++ f) {
+    index->mean[f] = (float)(mean[f] / size);
+  }
+
+  // 共分散行列の固有ベクトルを固有値の大きい順に主成分とする
+  double cov[ANN_FEATURE * ANN_FEATURE] = { 0.0 };
+  double vec[ANN_FEATURE * ANN_FEATURE];
+  for (int i = 0; i < size; ++ i) {
+    float const* const x = &raw[(size_t)i * ANN_FEATURE];
+    for (int f = 0; f < ANN_FEATURE; ++ f) {
+      for (int g = 0; g < ANN_FEATURE; ++ g) {
+        cov[f * ANN_FEATURE + g] += (double)(x[f] - index->mean[f]) * (x[g] - index->mean[g]);
+      }
+    }
+  }
+  solve_eigen(cov, vec, ANN_FEATURE);
+  bool chosen[ANN_FEATURE] = { false };
+  for (int d = 0; d < ANN_DIM; ++ d) {
+    int best = -1;
+    for (int f = 0; f < ANN_FEATURE; ++ f) {
+      if (!chosen[f] && (best < 0 || cov[f * ANN_FEATURE + f] > cov[best * ANN_FEATURE + best])) {
+        best = f;
+      }
+    }
+    chosen[best] = true;
+    for (int f = 0; f < ANN_FEATURE; ++ f) {
+      index->basis[d * ANN_FEATURE + f] = (float)vec[best * ANN_FEATURE + f];
+    }
+  }
+  #pragma omp parallel for schedule(static)
+  for (int i = 0; i < size; ++ i) {
+    project_feature(index, &raw[(size_t)i * ANN_FEATURE], &index->feature[(size_t)i * ANN_DIM]);
+  }
+  free(raw);
+
+  // k-means(初期値は等間隔に選んだパーツ、学習は等間隔に選んだ標本)
+  int const train = (size < ANN_TRAIN) ? size : ANN_TRAIN;
+  for (int c = 0; c < list_count; ++ c) {
+    memcpy(&index->centroid[c * ANN_DIM], &index->feature[(size_t)c * size / list_count * ANN_DIM], sizeof(float) * ANN_DIM);
+  }
+  double* sum = (double*)malloc(sizeof(double) * list_count * ANN_DIM);
+  int* count = (int*)malloc(sizeof(int) * list_count);
+  if (sum == NULL || count == NULL) {
+    free(count);
+    free(sum);
+    free_index(index);
+    return NULL;
+  }
+  for (int iter = 0; iter <= ANN_KMEANS_ITER; ++ iter) {
+    // 最後は全パーツを割り当てる
+    int const n = (iter < ANN_KMEANS_ITER) ? train : size;
+    #pragma omp parallel for schedule(static)
+    for (int k = 0; k < n; ++ k) {
+      int const i = (int)((size_t)k * size / n);
+      float const* const x = &index->feature[(size_t)i * ANN_DIM];
+      int best = 0;
+      float best_distance = distance_feature(x, &index->centroid[0]);
+      for (int c = 1; c < list_count; ++ c) {
+        float const distance = distance_feature(x, &index->centroid[c * ANN_DIM]);
+        if (distance < best_distance) {
+          best_distance = distance;
+          best = c;
+        }
+      }
+      index->cluster[i] = best;
+    }
+    if (iter == ANN_KMEANS_ITER) break;
+    memset(sum, 0, sizeof(double) * list_count * ANN_DIM);
+    memset(count, 0, sizeof(int) * list_count);
+    for (int k = 0; k < n; ++ k) {
+      int const i = (int)((size_t)k * size / n);
+      int const c = index->cluster[i];
+      for (int d = 0; d < ANN_DIM; ++ d) {
+        sum[c * ANN_DIM + d] += index->feature[(size_t)i * ANN_DIM + d];
+      }
+      ++ count[c];
+    }
+    // 空のクラスタは中心を動かさない
+    for (int c = 0; c < list_count; ++ c) {
+      if (count[c] == 0) continue;
+      for (int d = 0; d < ANN_DIM; ++ d) {
+        index->centroid[c * ANN_DIM + d] = (float)(sum[c * ANN_DIM + d] / count[c]);
+      }
+    }
+  }
+  free(sum);
+
+  // クラスタ毎にリストを連続して並べる
+  memset(count, 0, sizeof(int) * list_count);
+  for (int i = 0; i < size; ++ i) {
+    ++ count[index->cluster[i]];
+  }
+  index->list_begin[0] = 0;
+  for (int c = 0; c < list_count; ++ c) {
+    index->list_begin[c + 1] = index->list_begin[c] + count[c];
+    index->list_size[c] = 0;
+  }
+  for (int i = 0; i < size; ++ i) {
+    int const c = index->cluster[i];
+    int const slot = index->list_begin[c] + index->list_size[c] ++;
+    index->list[slot] = i;
+    index->slot[i] = slot;
+  }
+  free(count);
+
+  return index;
+}
+
+//////////////////////////////
+// 索引からパーツを削除(リストの末尾の有効な要素と入れ替える)
+//////////////////////////////
+void remove_index(index_t* const index, int const parts) {
+  int const c = index->cluster[parts];
+  int const last = index->list_begin[c] + index->list_size[c] - 1;
+  int const slot = index->slot[parts];
+  int const other = index->list[last];
+  index->list[slot] = other;
+  index->slot[other] = slot;
+  index->list[last] = parts;
+  index->slot[parts] = last;
+  -- index->list_size[c];
+}
+
+//////////////////////////////
+// 近傍探索(射影した特徴量に近いベースパーツを最大 ANN_TOP_K 個返す)
+// 中心が近い ANN_PROBE 個のリストを調べ、候補が足りなければリストを追加する。
+// 戻り値は候補数(距離の昇順、同じ距離なら添字の昇順)
+//////////////////////////////
+int search_index(index_t const* const index, float const* const query, int* const candidate) {
+  int const list_count = index->list_count;
+  // 中心が近い順にリストを選ぶ
+  int probe[ANN_PROBE];
+  float probe_distance[ANN_PROBE];
+  float top_distance[ANN_TOP_K];
+  int found = 0;
+  bool* visited = NULL;
+  int probed = 0;
+  while (found < ANN_TOP_K && probed < list_count) {
+    int probe_count = 0;
+    for (int c = 0; c < list_count; ++ c) {
+      if (index->list_size[c] == 0 || (visited != NULL && visited[c])) continue;
+      float const distance = distance_feature(query, &index->centroid[c * ANN_DIM]);
+      int k = (probe_count < ANN_PROBE) ? probe_count ++ : ANN_PROBE;
+      while (k > 0 && probe_distance[k - 1] > distance) {
+        if (k < ANN_PROBE) {
+          probe[k] = probe[k - 1];
+          probe_distance[k] = probe_distance[k - 1];
+        }
+        -- k;
+      }
+      if (k < ANN_PROBE) {
+        probe[k] = c;
+        probe_distance[k] = distance;
+      }
+    }
+    if (probe_count == 0) break;
+
+    // リスト内のパーツを距離の昇順に上位のみ残す
+    for (int p = 0; p < probe_count; ++ p) {
+      int const c = probe[p];
+      int const* const list = &index->list[index->list_begin[c]];
+      for (int j = 0; j < index->list_size[c]; ++ j) {
+        int const i = list[j];
+        float const distance = distance_feature(query, &index->feature[(size_t)i * ANN_DIM]);
+        int k = (found < ANN_TOP_K) ? found ++ : ANN_TOP_K;
+        while (k > 0 && (top_distance[k - 1] > distance ||
+                         (top_distance[k - 1] == distance && candidate[k - 1] > i))) {
+          if (k < ANN_TOP_K) {
+            candidate[k] = candidate[k - 1];
+            top_distance[k] = top_distance[k - 1];
+          }
+          -- k;
+        }
+        if (k < ANN_TOP_K) {
+          candidate[k] = i;
+          top_distance[k] = distance;
+        }
+      }
+    }
+
+    // 候補が足りない場合は調べたリストを除いて続ける
+    probed += probe_count;
+    if (found < ANN_TOP_K && probed < list_count) {
+      if (visited == NULL) {
+        visited = (bool*)calloc(list_count, sizeof(bool));
+        if (visited == NULL) break;
+      }
+      for (int p = 0; p < probe_count; ++ p) {
+        visited[probe[p]] = true;
+      }
+    }
+  }
+  free(visited);
+  return found;
+}
+
+//////////////////////////////
+// 近傍探索の索引の複製
+//////////////////////////////
+index_t* clone_index(index_t const* const index) {
+  int const size = index->size;
+  int const list_count = index->list_count;
+  index_t* clone = (index_t*)calloc(1, sizeof(index_t));
+  if (clone == NULL) {
+    return NULL;
+  }
+  clone->size = size;
+  clone->list_count = list_count;
+  clone->mean = (float*)malloc(sizeof(float) * ANN_FEATURE);
+  clone->basis = (float*)malloc(sizeof(float) * ANN_DIM * ANN_FEATURE);
+  clone->feature = (float*)malloc(sizeof(float) * size * ANN_DIM);
+  clone->centroid = (float*)malloc(sizeof(float) * list_count * ANN_DIM);
+  clone->list = (int*)malloc(sizeof(int) * size);
+  clone->list_begin = (int*)malloc(sizeof(int) * (list_count + 1));
+  clone->list_size = (int*)malloc(sizeof(int) * list_count);
+  clone->slot = (int*)malloc(sizeof(int) * size);
+  clone->cluster = (int*)malloc(sizeof(int) * size);
+  if (clone->mean == NULL || clone->basis == NULL || clone->feature == NULL || clone->centroid == NULL ||
+      clone->list == NULL || clone->list_begin == NULL || clone->list_size == NULL ||
+      clone->slot == NULL || clone->cluster == NULL) {
+    free_index(clone);
+    return NULL;
+  }
+  memcpy(clone->mean, index->mean, sizeof(float) * ANN_FEATURE);
+  memcpy(clone->basis, index->basis, sizeof(float) * ANN_DIM * ANN_FEATURE);
+  memcpy(clone->feature, index->feature, sizeof(float) * size * ANN_DIM);
+  memcpy(clone->centroid, index->centroid, sizeof(float) * list_count * ANN_DIM);
+  memcpy(clone->list, index->list, sizeof(int) * size);
+  memcpy(clone->list_begin, index->list_begin, sizeof(int) * (list_count + 1));
+  memcpy(clone->list_size, index->list_size, sizeof(int) * list_count);
+  memcpy(clone->slot, index->slot, sizeof(int) * size);
+  memcpy(clone->cluster, index->cluster, sizeof(int) * size);
+  return clone;
+}
+
+//////////////////////////////
+// 近傍探索の索引の開放
+//////////////////////////////
+void free_index(index_t* const index) {
+  if (index == NULL) return;
+  free(index->mean);
+  free(index->basis);
+  free(index->feature);
+  free(index->centroid);
+  free(index->list);
+  free(index->list_begin);
+  free(index->list_size);
+  free(index->slot);
+  free(index->cluster);
+  free(index);
+}
+
+//////////////////////////////
+// 近傍探索によるモザイクの並び替え(コストを使わない貪欲法)
+// 対象パーツを回転毎に索引で探索し、候補だけを二乗誤差で比べる。
+// ベースパーツを回転 r で比べることは対象パーツを -r 回転して比べることと同じため、
+// 索引はベースパーツの回転 0 のみを持つ
+//////////////////////////////
+int sort_mosaic_by_index(order_t const* const order, index_t const* const shared_index, image_t* const base_image, image_t* const target_image, mosaic_t* const mosaic, stats_t* const stats) {
+  // 共有された索引は削除で変わるため複製して使う
+  index_t* index = (shared_index != NULL) ? clone_index(shared_index) : create_index_by_image(base_image);
+  uint8_t* buffer = (uint8_t*)malloc(sizeof(uint8_t) * target_image->pixels);
+  if (index == NULL || buffer == NULL) {
+    free(buffer);
+    free_index(index);
+    return -1;
+  }
+  int removed = 0;
+  for (int b = 0; b < base_image->size; ++ b) {
+    if (base_image->locked[b]) {
+      remove_index(index, b);
+      ++ removed;
+    }
+  }
+#if MOSAIC_STATS
+  double step_start = get_time();
+  if (stats != NULL) {
+    stats->threads = 1;
+  }
+#endif
+
+  for (int i = 0; i < order->size; ++ i) {
+    coord_t const coord = order->coord[i];
+    int const target = coord.y * target_image->width + coord.x;
+    if (target_image->locked[target]) {
+      printf("parts[%d][%d] is locked.\n", coord.y, coord.x);
+      break;
+    }
+    uint32_t best_value = UINT32_MAX;
+    int best_rotation = 0;
+    int best_parts = -1;
+    for (int q = 0; q < ROTATION_SIZE; ++ q) {
+      // 対象パーツを q 回転したものはベースパーツの回転 -q に対応する
+      float feature[ANN_FEATURE];
+      float query[ANN_DIM];
+      int candidate[ANN_TOP_K];
+      create_feature(get_rotated_brightness(target_image, target, q, buffer), target_image->parts_size, feature);
+      project_feature(index, feature, query);
+      int const found = search_index(index, query, candidate);
+      if (stats != NULL) {
+        stats->prune.candidate += found;
+        stats->prune.full += found;
+#if MOSAIC_STATS
+        stats->thread[0].candidate += found;
+        stats->thread[0].diff += found;
+#endif
+      }
+      position_t position;
+      position.rotation = (ROTATION_SIZE - q) % ROTATION_SIZE;
+      for (int k = 0; k < found; ++ k) {
+        position.parts = candidate[k];
+        uint32_t const value = diff(target_image, target, base_image, &position);
+        if (value < best_value ||
+            (value == best_value && (position.parts < best_parts ||
+                                     (position.parts == best_parts && position.rotation < best_rotation)))) {
+          best_value = value;
+          best_rotation = position.rotation;
+          best_parts = position.parts;
+        }
+      }
+    }
+    if (best_parts < 0) break;
+#if MOSAIC_STATS
+    if (stats != NULL) {
+      double const now = get_time();
+      record_step(stats, target, best_value, now - step_start);
+      stats->locked += removed;
+      step_start = now;
+    }
+#endif
+
+    // パーツを確定する
+    position_t position;
+    position.rotation = best_rotation;
+    position.parts = best_parts;
+    mosaic->position[target] = position;
+    base_image->locked[best_parts] = true;
+    target_image->locked[target] = true;
+    remove_index(index, best_parts);
+    ++ removed;
+  }
+
+  free(buffer);
+  free_index(index);
+  return 0;
+}
+
+//////////////////////////////
+// マニフェストの読み込み
+// 1 行に 1 つ、対象画像のファイル名と位置引数(X軸, Y軸, 輝度)を空白区切りで書く(空行は無視)。
+// 出力ファイル名は対象画像のファイル名から決めるため、同じ名前になる行があればエラーとする
+//////////////////////////////
+job_t* create_job_by_file(char const* const file_name, int* const size) {
+  FILE* fp = fopen(file_name, "r");
+  if (fp == NULL) return NULL;
+
+  int capacity = 16;
+  int count = 0;
+  job_t* job = (job_t*)malloc(sizeof(job_t) * capacity);
+  if (job == NULL) {
+    fclose(fp);
+    return NULL;
+  }
+  char line[FILE_NAME_SIZE + 64];
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    job_t entry;
+    int value[3];
+    int const n = sscanf(line, "%255s %d %d %d", entry.target_file, &value[0], &value[1], &value[2]);
+    if (n <= 0) continue;
+    // 座標は X軸と Y軸をセットで指定する
+    if (n == 2) {
+      free(job);
+      fclose(fp);
+      return NULL;
+    }
+    entry.argc = n - 1;
+    entry.dx = (n > 1) ? value[0] : 0;
+    entry.dy = (n > 1) ? value[1] : 0;
+    entry.brightness = (n > 3) ? value[2] : 0;
+    create_result_name(entry.result_txt, FILE_NAME_SIZE, entry.target_file, RESULT_TXT);
+    create_result_name(entry.result_bmp, FILE_NAME_SIZE, entry.target_file, RESULT_BMP);
+    create_result_name(entry.cost_file, FILE_NAME_SIZE, entry.target_file, COST_FILE_NAME);
+    entry.result = -1;
+    entry.value = 0;
+    entry.time = 0.0;
+    for (int i = 0; i < count; ++ i) {
+      if (strcmp(job[i].result_txt, entry.result_txt) == 0) {
+        free(job);
+        fclose(fp);
+        return NULL;
+      }
+    }
+    if (count == capacity) {
+      capacity *= 2;
+      job_t* const grown = (job_t*)realloc(job, sizeof(job_t) * capacity);
+      if (grown == NULL) {
+        free(job);
+        fclose(fp);
+        return NULL;
+      }
+      job = grown;
+    }
+    job[count ++] = entry;
+  }
+  fclose(fp);
+
+  if (count == 0) {
+    free(job);
+    return NULL;
+  }
+  *size = count;
+  return job;
+}
+
+//////////////////////////////
+// 1 つの対象画像の並び替えとエクスポート(一括処理用、途中経過は表示しない)
+// ベース画像は複製してから使うため、複数のスレッドから同時に呼び出せる
+//////////////////////////////
+int solve_job(option_t const* const option, share_t const* const share, image_t const* const base_image, job_t* const job) {
+  double const start = get_time();
+
+  // 画像オブジェクトの生成
+  image_t* target_image = create_image_by_file(job->target_file,
+                                               option->grid_width > 0 ? option->grid_width : base_image->width,
+                                               option->grid_height > 0 ? option->grid_height : base_image->height,
+                                               option->parts_size, ROTATION_SIZE, option->color);
+  image_t* base = clone_image(base_image);
+  if (target_image == NULL || base == NULL ||
+      base->width != target_image->width || base->height != target_image->height ||
+      base->parts_size != target_image->parts_size) {
+    free_image(base);
+    free_image(target_image);
+    return -1;
+  }
+
+  // 座標を動かす
+  if (job->argc > 1) {
+    add_coord(target_image, job->dx, job->dy);
+  }
+
+  // コストの読み込みと計算(近傍探索と直接計算では使わない)
+  cost_t* cost = NULL;
+  if (option->solver != SOLVER_ANN && !option->direct) {
+    cost = create_cost_by_file(job->cost_file, base, target_image);
+    if (cost == NULL) {
+      cost = create_cost_by_image(base, target_image);
+      if (cost == NULL) {
+        free_image(base);
+        free_image(target_image);
+        return -1;
+      }
+      export_cost_to_file(job->cost_file, cost, base, target_image);
+    }
+  }
+
+  // 輝度を増加させる
+  if (job->argc > 2) {
+    moment_t* base_moment = create_moment_by_image(base);
+    moment_t* target_moment = create_moment_by_image(target_image);
+    if (base_moment == NULL || target_moment == NULL) {
+      free_moment(target_moment);
+      free_moment(base_moment);
+      free_cost(cost);
+      free_image(base);
+      free_image(target_image);
+      return -1;
+    }
+    add_brightness(target_image, job->brightness);
+    if (cost != NULL) {
+      update_cost_by_brightness(cost, cost, base_moment, target_moment, base, target_image, job->brightness);
+    }
+    free_moment(target_moment);
+    free_moment(base_moment);
+  }
+
+  // モザイクの並び替え
+  stats_t* stats = alloc_stats(target_image->size);
+  mosaic_t* mosaic = create_mosaic_by_image(base);
+  order_t* order = create_order_by_center(target_image->width, target_image->height);
+  if (stats == NULL || mosaic == NULL || order == NULL ||
+      solve_mosaic(option->solver, order, cost, share, base, target_image, mosaic, stats) < 0 ||
+      !check_image(base) || !check_image(target_image) || !check_mosaic(mosaic)) {
+    free_stats(stats);
+    free_order(order);
+    free_mosaic(mosaic);
+    free_cost(cost);
+    free_image(base);
+    free_image(target_image);
+    return -1;
+  }
+  job->value = evaluate_mosaic(mosaic, target_image);
+
+  // エクスポート
+  int result = 0;
+  if (export_mosaic_to_txt(job->result_txt, mosaic) < 0 || export_mosaic_to_bmp(job->result_bmp, mosaic) < 0) {
+    result = -1;
+  }
+#if MOSAIC_STATS
+  char stats_file[FILE_NAME_SIZE];
+  create_result_name(stats_file, FILE_NAME_SIZE, job->result_txt, STATS_FILE_NAME);
+  export_stats_to_json(stats_file, stats, SOLVER_NAME[option->solver], mosaic, target_image);
+#endif
+
+  // メモリ開放
+  free_stats(stats);
+  free_order(order);
+  free_mosaic(mosaic);
+  free_cost(cost);
+  free_image(base);
+  free_image(target_image);
+  job->time = get_time() - start;
+  return result;
+}
+
+//////////////////////////////
+// マニフェストの対象画像を一括で並び替え
+// ベース画像の下界・索引は 1 度だけ作って全ての対象画像で共有し、対象画像毎に並列に処理する
+//////////////////////////////
+int batch_mosaic(option_t const* const option, image_t const* const base_image) {
+  // マニフェストの読み込み
+  printf("load batch [%s] ... ", option->batch);
+  int size = 0;
+  job_t* job = create_job_by_file(option->batch, &size);
+  if (job == NULL) {
+    printf("error\n");
+    return -1;
+  }
+  printf("ok (%d jobs)\n", size);
+
+  // ベース画像の共有データの生成
+  printf("create share ... ");
+  share_t share;
+  share.bound = option->direct ? create_bound_by_image(base_image) : NULL;
+  share.index = (option->solver == SOLVER_ANN) ? create_index_by_image(base_image) : NULL;
+  if ((option->direct && share.bound == NULL) || (option->solver == SOLVER_ANN && share.index == NULL)) {
+    free_index(share.index);
+    free_bound(share.bound);
+    free(job);
+    printf("error\n");
+    return -1;
+  }
+  printf("ok\n");
+
+  // 対象画像毎に並列に並び替える(各ジョブの中の並列化は入れ子になるため逐次で実行される)
+  double const start = get_time();
+  int failed = 0;
+  #pragma omp parallel for schedule(dynamic) reduction(+:failed)
+  for (int i = 0; i < size; ++ i) {
+    job[i].result = solve_job(option, &share, base_image, &job[i]);
+    if (job[i].result < 0) {
+      ++ failed;
+    }
+    #pragma omp critical
+    {
+      if (job[i].result < 0) {
+        printf("solve [%s] ... error\n", job[i].target_file);
+      } else {
+        printf("solve [%s] ... ok (%llu, %.1f ms)\n", job[i].target_file, (unsigned long long)job[i].value, job[i].time * 1000.0);
+      }
+      fflush(stdout);
     }
   }
+  printf("batch ... %d/%d ok (%.1f ms)\n", size - failed, size, (get_time() - start) * 1000.0);
+
+  // メモリ開放
+  free_index(share.index);
+  free_bound(share.bound);
+  free(job);
+  return (failed > 0) ? -1 : 0;
+}
+
+//////////////////////////////
+// 処理時間の比較(昇順)
+//////////////////////////////
+int compare_time(void const* const a, void const* const b) {
+  double const ta = *(double const*)a;
+  double const tb = *(double const*)b;
+  if (ta != tb) return ta < tb ? -1 : 1;
+  return 0;
+}
+
+//////////////////////////////
+// 1 つの対象画像で各段階の処理時間を計測
+// time は [段階][繰り返し]、eval は段階毎の差異の計算回数(1 回分)
+//////////////////////////////
+int bench_job(option_t const* const option, job_t const* const job, int const iterations, double* const time, uint64_t* const eval, int* const tiles) {
+  for (int i = 0; i < iterations; ++ i) {
+    // 画像の読み込み
+    double t = get_time();
+    image_t* base_image = create_image_by_file(option->base_file, option->grid_width, option->grid_height, option->parts_size, 1, option->color);
+    image_t* target_image = (base_image == NULL) ? NULL :
+      create_image_by_file(job->target_file,
+                           option->grid_width > 0 ? option->grid_width : base_image->width,
+                           option->grid_height > 0 ? option->grid_height : base_image->height,
+                           option->parts_size, ROTATION_SIZE, option->color);
+    if (base_image == NULL || target_image == NULL ||
+        base_image->width != target_image->width || base_image->height != target_image->height ||
+        base_image->parts_size != target_image->parts_size) {
+      free_image(target_image);
+      free_image(base_image);
+      return -1;
+    }
+    time[BENCH_LOAD * iterations + i] = get_time() - t;
+    *tiles = target_image->size;
+
+    // 座標を動かす
+    t = get_time();
+    add_coord(target_image, job->dx, job->dy);
+    time[BENCH_COORD * iterations + i] = get_time() - t;
+
+    // コストの計算(ファイルには保存しない)
+    t = get_time();
+    cost_t* cost = NULL;
+    if (option->solver != SOLVER_ANN && !option->direct) {
+      cost = create_cost_by_image(base_image, target_image);
+      if (cost == NULL) {
+        free_image(target_image);
+        free_image(base_image);
+        return -1;
+      }
+      eval[BENCH_COST] = (uint64_t)cost->target_size * cost->base_size * ROTATION_SIZE;
+    }
+    time[BENCH_COST * iterations + i] = get_time() - t;
+
+    // 輝度を増加させる
+    t = get_time();
+    moment_t* base_moment = create_moment_by_image(base_image);
+    moment_t* target_moment = create_moment_by_image(target_image);
+    if (base_moment == NULL || target_moment == NULL) {
+      free_moment(target_moment);
+      free_moment(base_moment);
+      free_cost(cost);
+      free_image(target_image);
+      free_image(base_image);
+      return -1;
+    }
+    add_brightness(target_image, job->brightness);
+    if (cost != NULL) {
+      update_cost_by_brightness(cost, cost, base_moment, target_moment, base_image, target_image, job->brightness);
+    }
+    free_moment(target_moment);
+    free_moment(base_moment);
+    time[BENCH_BRIGHTNESS * iterations + i] = get_time() - t;
+
+    // モザイクの並び替え
+    t = get_time();
+    stats_t* stats = alloc_stats(target_image->size);
+    mosaic_t* mosaic = create_mosaic_by_image(base_image);
+    order_t* order = create_order_by_center(target_image->width, target_image->height);
+    if (stats == NULL || mosaic == NULL || order == NULL ||
+        solve_mosaic(option->solver, order, cost, NULL, base_image, target_image, mosaic, stats) < 0) {
+      free_stats(stats);
+      free_order(order);
+      free_mosaic(mosaic);
+      free_cost(cost);
+      free_image(target_image);
+      free_image(base_image);
+      return -1;
+    }
+    time[BENCH_SORT * iterations + i] = get_time() - t;
+    // コストを使う場合は計算済みの値を参照するだけなので、差異の計算は直接計算した分のみ
+    eval[BENCH_SORT] = stats->prune.partial + stats->prune.full;
+    free_stats(stats);
+
+    // エクスポート
+    t = get_time();
+    int const result_txt = export_mosaic_to_txt(job->result_txt, mosaic);
+    time[BENCH_TXT * iterations + i] = get_time() - t;
+    t = get_time();
+    int const result_bmp = export_mosaic_to_bmp(job->result_bmp, mosaic);
+    time[BENCH_BMP * iterations + i] = get_time() - t;
+
+    // メモリ開放
+    free_order(order);
+    free_mosaic(mosaic);
+    free_cost(cost);
+    free_image(target_image);
+    free_image(base_image);
+    if (result_txt < 0 || result_bmp < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+//////////////////////////////
+// 各段階の処理時間の計測結果を JSON で出力
+// 対象画像は --target(位置引数を含む)、または --batch のマニフェストの全件
+//////////////////////////////
+int bench_mosaic(option_t const* const option) {
+  int const iterations = option->bench;
+  int size = 1;
+  job_t* job = NULL;
+  if (option->batch != NULL) {
+    job = create_job_by_file(option->batch, &size);
+  } else {
+    job = (job_t*)malloc(sizeof(job_t));
+    if (job != NULL) {
+      snprintf(job->target_file, FILE_NAME_SIZE, "%s", option->target_file);
+      job->argc = option->argc;
+      job->dx = (option->argc > 1) ? atoi(option->argv[0]) : 0;
+      job->dy = (option->argc > 1) ? atoi(option->argv[1]) : 0;
+      job->brightness = (option->argc > 2) ? atoi(option->argv[2]) : 0;
+      snprintf(job->result_txt, FILE_NAME_SIZE, "%s", option->result_txt);
+      snprintf(job->result_bmp, FILE_NAME_SIZE, "%s", option->result_bmp);
+    }
+  }
+  double* time = (double*)malloc(sizeof(double) * BENCH_STAGES * iterations);
+  if (job == NULL || time == NULL) {
+    free(time);
+    free(job);
+    printf("{ \"error\": \"load\" }\n");
+    return -1;
+  }
+
+  printf("{\n");
+  printf("  \"base\": \"%s\",\n", option->base_file);
+  printf("  \"solver\": \"%s\",\n", SOLVER_NAME[option->solver]);
+  printf("  \"direct\": %s,\n", option->direct ? "true" : "false");
+  printf("  \"iterations\": %d,\n", iterations);
+  printf("  \"datasets\": [");
+  int result = 0;
+  for (int j = 0; j < size; ++ j) {
+    uint64_t eval[BENCH_STAGES] = { 0 };
+    int tiles = 0;
+    if (bench_job(option, &job[j], iterations, time, eval, &tiles) < 0) {
+      printf("%s\n    { \"target\": \"%s\", \"error\": true }", (j > 0) ? "," : "", job[j].target_file);
+      result = -1;
+      continue;
+    }
+    printf("%s\n    {\n", (j > 0) ? "," : "");
+    printf("      \"target\": \"%s\",\n", job[j].target_file);
+    printf("      \"dx\": %d, \"dy\": %d, \"brightness\": %d,\n", job[j].dx, job[j].dy, job[j].brightness);
+    printf("      \"tiles\": %d,\n", tiles);
+    printf("      \"stages\": [\n");
+    for (int s = 0; s < BENCH_STAGES; ++ s) {
+      // 最小値・中央値・99 パーセンタイル(最近傍順位)
+      double* const sample = &time[s * iterations];
+      qsort(sample, iterations, sizeof(double), compare_time);
+      double const min = sample[0];
+      double const median = sample[iterations / 2];
+      double const p99 = sample[(int)ceil(iterations * 0.99) - 1];
+      printf("        { \"name\": \"%s\", \"min_ms\": %.3f, \"median_ms\": %.3f, \"p99_ms\": %.3f, "
+             "\"tiles_per_s\": %.1f, \"evals\": %llu, \"evals_per_s\": %.1f }%s\n",
+             BENCH_STAGE_NAME[s], min * 1000.0, median * 1000.0, p99 * 1000.0,
+             (median > 0.0) ? tiles / median : 0.0, (unsigned long long)eval[s],
+             (median > 0.0) ? eval[s] / median : 0.0, (s + 1 < BENCH_STAGES) ? "," : "");
+    }
+    printf("      ]\n");
+    printf("    }");
+  }
+  printf("\n  ]\n");
+  printf("}\n");
+
+  free(time);
+  free(job);
+  return result;
+}
+
+//////////////////////////////
+// 計測オブジェクトの生成(size は記録できるステップ数)
+//////////////////////////////
+stats_t* alloc_stats(int const size) {
+  stats_t* stats = (stats_t*)calloc(1, sizeof(stats_t));
+  if (stats == NULL) {
+    return NULL;
+  }
+  stats->size = size;
+  stats->step_target = (int*)malloc(sizeof(int) * size);
+  stats->step_value = (uint32_t*)malloc(sizeof(uint32_t) * size);
+  if (stats->step_target == NULL || stats->step_value == NULL) {
+    free_stats(stats);
+    return NULL;
+  }
+  return stats;
+}
+
+//////////////////////////////
+// 計測オブジェクトの開放
+//////////////////////////////
+void free_stats(stats_t* const stats) {
+  if (stats == NULL) return;
+  free(stats->step_target);
+  free(stats->step_value);
+  free(stats);
+}
+
+//////////////////////////////
+// ステップの記録(対象パーツ、最小の差異、処理時間)
+//////////////////////////////
+void record_step(stats_t* const stats, int const target, uint32_t const value, double const time) {
+  if (stats->steps < stats->size) {
+    stats->step_target[stats->steps] = target;
+    stats->step_value[stats->steps] = value;
+    ++ stats->steps;
+  }
+  // 1 マイクロ秒未満を 0 番目とし、以降は 2 倍毎の区間に分ける
+  double us = time * 1e6;
+  int k = 0;
+  while (us >= 1.0 && k < STATS_BUCKETS - 1) {
+    us /= 2.0;
+    ++ k;
+  }
+  ++ stats->histogram[k];
+}
+
+//////////////////////////////
+// 計測結果を JSON でエクスポート
+// スレッド毎の件数、枝刈りの件数、ステップ毎の処理時間の分布と最小の差異の推移、
+// 最終的なパーツ毎の差異を出力する
+//////////////////////////////
+int export_stats_to_json(char const* const file_name, stats_t const* const stats, char const* const solver, mosaic_t const* const mosaic, image_t const* const target_image) {
+  FILE* fp = fopen(file_name, "w");
+  if (fp == NULL) return -1;
+
+  fprintf(fp, "{\n");
+  fprintf(fp, "  \"solver\": \"%s\",\n", solver);
+  fprintf(fp, "  \"width\": %d,\n", mosaic->width);
+  fprintf(fp, "  \"height\": %d,\n", mosaic->height);
+  fprintf(fp, "  \"sort_ms\": %.3f,\n", stats->time * 1000.0);
+  fprintf(fp, "  \"locked\": %llu,\n", (unsigned long long)stats->locked);
+  fprintf(fp, "  \"prune\": { \"candidate\": %llu, \"mean\": %llu, \"lowres\": %llu, \"partial\": %llu, \"full\": %llu },\n",
+          (unsigned long long)stats->prune.candidate, (unsigned long long)stats->prune.mean, (unsigned long long)stats->prune.lowres,
+          (unsigned long long)stats->prune.partial, (unsigned long long)stats->prune.full);
+
+  // スレッド毎の件数
+  fprintf(fp, "  \"threads\": [");
+  for (int t = 0; t < stats->threads; ++ t) {
+    stats_thread_t const* const thread = &stats->thread[t];
+    fprintf(fp, "%s\n    { \"thread\": %d, \"candidate\": %llu, \"lookup\": %llu, \"diff\": %llu }", (t > 0) ? "," : "", t,
+            (unsigned long long)thread->candidate, (unsigned long long)thread->lookup, (unsigned long long)thread->diff);
+  }
+  fprintf(fp, "\n  ],\n");
+
+  // ステップ毎の処理時間の分布(le_us 未満の件数)
+  fprintf(fp, "  \"step_histogram\": [");
+  for (int k = 0; k < STATS_BUCKETS; ++ k) {
+    fprintf(fp, "%s\n    { \"le_us\": %llu, \"count\": %llu }", (k > 0) ? "," : "",
+            (unsigned long long)1 << k, (unsigned long long)stats->histogram[k]);
+  }
+  fprintf(fp, "\n  ],\n");
+
+  // ステップ毎の最小の差異の推移
+  fprintf(fp, "  \"steps\": [");
+  for (int i = 0; i < stats->steps; ++ i) {
+    int const target = stats->step_target[i];
+    fprintf(fp, "%s\n    { \"y\": %d, \"x\": %d, \"value\": %u }", (i > 0) ? "," : "",
+            target / mosaic->width, target % mosaic->width, stats->step_value[i]);
+  }
+  fprintf(fp, "\n  ],\n");
+
+  // パーツ毎の最終的な差異
+  uint64_t total = 0;
+  fprintf(fp, "  \"tiles\": [");
+  for (int i = 0; i < target_image->size; ++ i) {
+    position_t const* const position = &mosaic->position[i];
+    uint32_t const value = diff(target_image, i, mosaic->image, position);
+    total += value;
+    fprintf(fp, "%s\n    { \"y\": %d, \"x\": %d, \"parts\": %d, \"rotation\": %d, \"value\": %u }", (i > 0) ? "," : "",
+            i / mosaic->width, i % mosaic->width, mosaic->image->no[position->parts], position->rotation, value);
+  }
+  fprintf(fp, "\n  ],\n");
+  fprintf(fp, "  \"total\": %llu\n", (unsigned long long)total);
+  fprintf(fp, "}\n");
+
+  fclose(fp);
+  return 0;
+}
+
+//////////////////////////////
+// 指定された方式でモザイクを並び替え
+//////////////////////////////
+int solve_mosaic(int const solver, order_t const* const order, cost_t const* const cost, share_t const* const share, image_t* const base_image, image_t* const target_image, mosaic_t* const mosaic, stats_t* const stats) {
+  double const start = get_time();
+  int result = 0;
+  switch (solver) {
+  case SOLVER_LAP:
+    result = sort_mosaic_by_assign(solve_lap, cost, base_image, target_image, mosaic);
+    break;
+  case SOLVER_AUCTION:
+    result = sort_mosaic_by_assign(solve_auction, cost, base_image, target_image, mosaic);
+    break;
+  case SOLVER_PQ:
+    result = sort_mosaic_by_assign(solve_pq, cost, base_image, target_image, mosaic);
+    break;
+  case SOLVER_ANN:
+    result = sort_mosaic_by_index(order, (share != NULL) ? share->index : NULL, base_image, target_image, mosaic, stats);
+    break;
+  default:
+    result = sort_mosaic(order, cost, (share != NULL) ? share->bound : NULL, base_image, target_image, mosaic, stats);
+    break;
+  }
+  if (stats != NULL) {
+    stats->time = get_time() - start;
+  }
+  return result;
+}
+
+//////////////////////////////
+// 位置合わせの候補の比較(残差の昇順)
+//////////////////////////////
+int compare_align(void const* const a, void const* const b) {
+  align_t const* const pa = (align_t const*)a;
+  align_t const* const pb = (align_t const*)b;
+  if (pa->residual != pb->residual) return pa->residual < pb->residual ? -1 : 1;
+  if (pa->dy != pb->dy) return pb->dy < pa->dy ? -1 : 1;
+  if (pa->dx != pb->dx) return pb->dx < pa->dx ? -1 : 1;
+  return 0;
+}
+
+//////////////////////////////
+// 積分画像から矩形 [x0, x1) x [y0, y1) の総和を求める
+//////////////////////////////
+int64_t sum_rect(int64_t const* const sum, size_t const stride, int const x0, int const y0, int const x1, int const y1) {
+  if (x0 >= x1 || y0 >= y1) return 0;
+  return sum[y1 * stride + x1] - sum[y0 * stride + x1] - sum[y1 * stride + x0] + sum[y0 * stride + x0];
+}
+
+//////////////////////////////
+// 座標を動かした場合の差異の総和を、並び替えずに全ての座標について見積もる
+// ベースパーツの平均輝度を昇順に並べたものを代理画像とし、座標を動かした後の対象パーツの平均輝度を
+// 同じ順位の代理画像の値と組み合わせた二乗誤差(残差)が小さい順に並べる。
+// パーツを 1 対 1 で割り当てる場合の平均輝度のみの最適な割当てに当たり、輝度の補正値は平均の差として解析的に求まる。
+// 対象パーツの平均輝度は積分画像から座標毎に O(1) で求める。カラーは輝度(Y)で比較する。
+// align にはパーツの一辺の二乗の数の領域を渡す
+//////////////////////////////
+int align_mosaic(image_t const* const base_image, image_t const* const target_image, align_t* const align) {
+  int const parts_size = target_image->parts_size;
+  int const pixels = target_image->pixels;
+  int const size = target_image->size;
+  int const width = target_image->width * parts_size;
+  int const height = target_image->height * parts_size;
+  size_t const stride = (size_t)width + 1;
+
+  // 対象画像の輝度の積分画像と、ベースパーツの平均輝度(昇順)
+  int64_t* sum = (int64_t*)calloc(stride * (height + 1), sizeof(int64_t));
+  uint8_t* luminance = (uint8_t*)malloc(sizeof(uint8_t) * width);
+  double* proxy = (double*)malloc(sizeof(double) * base_image->size);
+  if (sum == NULL || luminance == NULL || proxy == NULL || base_image->size != size) {
+    free(proxy);
+    free(luminance);
+    free(sum);
+    return -1;
+  }
+  for (int y = 0; y < height; ++ y) {
+    int const iy = y / parts_size;
+    int const py = y % parts_size;
+    for (int ix = 0; ix < target_image->width; ++ ix) {
+      uint8_t const* const data = get_brightness(target_image, iy * target_image->width + ix, 0);
+      for (int px = 0; px < parts_size; ++ px) {
+        int rgb[CHANNEL_SIZE];
+        decode_color(target_image->color, &data[py * parts_size + px], pixels, rgb);
+        luminance[ix * parts_size + px] = convert_gray(rgb[0], rgb[1], rgb[2]);
+      }
+    }
+    int64_t row = 0;
+    for (int x = 0; x < width; ++ x) {
+      row += luminance[x];
+      sum[(y + 1) * stride + x + 1] = sum[y * stride + x + 1] + row;
+    }
+  }
+  double base_mean = 0.0;
+  for (int i = 0; i < size; ++ i) {
+    uint8_t const* const data = get_brightness(base_image, i, 0);
+    int total = 0;
+    for (int p = 0; p < pixels; ++ p) {
+      int rgb[CHANNEL_SIZE];
+      decode_color(base_image->color, &data[p], pixels, rgb);
+      total += convert_gray(rgb[0], rgb[1], rgb[2]);
+    }
+    proxy[i] = (double)total / pixels;
+    base_mean += proxy[i];
+  }
+  base_mean /= size;
+  qsort(proxy, size, sizeof(double), compare_time);
+
+  // 座標毎に独立して計算できるため並列化する
+  bool error = false;
+  #pragma omp parallel for schedule(dynamic)
+  for (int shift = 0; shift < parts_size * parts_size; ++ shift) {
+    int const dx = shift % parts_size;
+    int const dy = shift / parts_size;
+    double* mean = (double*)malloc(sizeof(double) * size);
+    if (mean == NULL) {
+      #pragma omp atomic write
+      error = true;
+      continue;
+    }
+    double target_mean = 0.0;
+    for (int i = 0; i < size; ++ i) {
+      // add_coord は動かした先が画像の外になる画素を元の値のまま残すため、
+      // 動かす部分(x1, y1 まで)は元の画像の (dx, dy) 先の総和、残りは元の位置の総和とする
+      int const x0 = i % target_image->width * parts_size;
+      int const y0 = i / target_image->width * parts_size;
+      int const x1 = (x0 + parts_size < width - dx) ? x0 + parts_size : width - dx;
+      int const y1 = (y0 + parts_size < height - dy) ? y0 + parts_size : height - dy;
+      int64_t const total = sum_rect(sum, stride, x0 + dx, y0 + dy, x1 + dx, y1 + dy) +
+                            sum_rect(sum, stride, x0, y0, x0 + parts_size, y0 + parts_size) - sum_rect(sum, stride, x0, y0, x1, y1);
+      mean[i] = (double)total / pixels;
+      target_mean += mean[i];
+    }
+    target_mean /= size;
+    qsort(mean, size, sizeof(double), compare_time);
+
+    // 同じ順位の組み合わせの二乗誤差は、平均の差だけ輝度を補正した場合に最小となる
+    double const brightness = base_mean - target_mean;
+    double residual = 0.0;
+    for (int i = 0; i < size; ++ i) {
+      double const d = mean[i] + brightness - proxy[i];
+      residual += d * d;
+    }
+    free(mean);
+
+    align_t* const a = &align[shift];
+    a->dx = -dx;
+    a->dy = -dy;
+    a->residual = residual * pixels / size;
+    a->brightness = (int)floor(brightness + 0.5);
+  }
+  free(proxy);
+  free(luminance);
+  free(sum);
+  if (error) {
+    return -1;
+  }
+  qsort(align, parts_size * parts_size, sizeof(align_t), compare_align);
+  return 0;
+}
+
+//////////////////////////////
+// 1 つの座標について全ての輝度でモザイクを並び替えて評価
+// 座標を動かした時だけコストを計算し、輝度はコストの差分更新で扱う。
+// モザイクは共有のベース画像を指すように付け替えて返す
+//////////////////////////////
+int evaluate_sweep(int const solver, order_t const* const order, image_t const* const base_image, moment_t const* const base_moment, image_t const* const target_image, sweep_t* const sweep, int const count) {
+  for (int i = 0; i < count; ++ i) {
+    sweep[i].mosaic = NULL;
+  }
+
+  // 並び替えでロック状態が変わるため、画像オブジェクトを複製する
+  image_t* shifted = clone_image(target_image);
+  image_t* target = clone_image(target_image);
+  image_t* base = clone_image(base_image);
+  if (shifted == NULL || target == NULL || base == NULL) {
+    free_image(base);
+    free_image(target);
+    free_image(shifted);
+    return -1;
+  }
+  add_coord(shifted, sweep[0].dx, sweep[0].dy);
+
+  cost_t* const origin = create_cost_by_image(base_image, shifted);
+  moment_t* const target_moment = create_moment_by_image(shifted);
+  cost_t* const cost = (origin != NULL) ? alloc_cost(origin->target_size, origin->base_size) : NULL;
+  if (origin == NULL || target_moment == NULL || cost == NULL) {
+    free_cost(cost);
+    free_moment(target_moment);
+    free_cost(origin);
+    free_image(base);
+    free_image(target);
+    free_image(shifted);
+    return -1;
+  }
+
+  int result = 0;
+  for (int i = 0; i < count; ++ i) {
+    copy_image(base, base_image);
+    copy_image(target, shifted);
+    add_brightness(target, sweep[i].brightness);
+    update_cost_by_brightness(cost, origin, base_moment, target_moment, base_image, target, sweep[i].brightness);
+
+    mosaic_t* mosaic = create_mosaic_by_image(base);
+    if (mosaic == NULL || solve_mosaic(solver, order, cost, NULL, base, target, mosaic, NULL) < 0) {
+      free_mosaic(mosaic);
+      result = -1;
+      break;
+    }
+    sweep[i].value = evaluate_mosaic_by_cost(mosaic, cost);
+    mosaic->image = base_image;
+    sweep[i].mosaic = mosaic;
+  }
+
+  free_cost(cost);
+  free_moment(target_moment);
+  free_cost(origin);
+  free_image(base);
+  free_image(target);
+  free_image(shifted);
+  return result;
+}
+
+//////////////////////////////
+// 探索結果の比較(差異の総和の昇順)
+//////////////////////////////
+int compare_sweep(void const* const a, void const* const b) {
+  sweep_t const* const sa = (sweep_t const*)a;
+  sweep_t const* const sb = (sweep_t const*)b;
+  if (sa->value != sb->value) return sa->value < sb->value ? -1 : 1;
+  if (sa->brightness != sb->brightness) return sa->brightness < sb->brightness ? -1 : 1;
+  if (sa->dy != sb->dy) return sb->dy < sa->dy ? -1 : 1;
+  if (sa->dx != sb->dx) return sb->dx < sa->dx ? -1 : 1;
+  return 0;
+}
+
+//////////////////////////////
+// 座標と輝度のパラメータを一括探索し、上位の結果をエクスポート
+// 位置合わせを指定した場合は、見積もりの上位の座標だけを並び替える
+// (輝度の探索を指定しなければ、輝度は見積もった補正値のみとする)
+//////////////////////////////
+int sweep_mosaic(option_t const* const option, image_t const* const base_image, image_t const* const target_image) {
+  int const parts_size = target_image->parts_size;
+  int shift_count = parts_size * parts_size;
+  align_t* align = NULL;
+  if (option->align > 0) {
+    printf("align mosaic ... ");
+    fflush(stdout);
+    align = (align_t*)malloc(sizeof(align_t) * shift_count);
+    if (align == NULL || align_mosaic(base_image, target_image, align) < 0) {
+      free(align);
+      printf("error\n");
+      return -1;
+    }
+    printf("ok\n");
+    if (option->align < shift_count) shift_count = option->align;
+    for (int k = 0; k < shift_count; ++ k) {
+      align_t const* const a = &align[k];
+      printf("candidate %d [x:%d, y:%d] ... residual %.1f (brightness %d)\n", k + 1, a->dx, a->dy, a->residual, a->brightness);
+    }
+  }
+  int const brightness_count = option->sweep ? (option->sweep_max - option->sweep_min) / option->sweep_step + 1 : 1;
+  int const count = shift_count * brightness_count;
+
+  // メモリ確保
+  if (align == NULL) {
+    printf("sweep mosaic [%s, x:%d..0, y:%d..0, brightness:%d..%d] ... ", SOLVER_NAME[option->solver],
+           1 - parts_size, 1 - parts_size, option->sweep_min, option->sweep_max);
+  } else if (option->sweep) {
+    printf("sweep mosaic [%s, candidates:%d, brightness:%d..%d] ... ", SOLVER_NAME[option->solver],
+           shift_count, option->sweep_min, option->sweep_max);
+  } else {
+    printf("sweep mosaic [%s, candidates:%d] ... ", SOLVER_NAME[option->solver], shift_count);
+  }
+  fflush(stdout);
+  sweep_t* sweep = (sweep_t*)malloc(sizeof(sweep_t) * count);
+  order_t* order = create_order_by_center(target_image->width, target_image->height);
+  moment_t* base_moment = create_moment_by_image(base_image);
+  if (sweep == NULL || order == NULL || base_moment == NULL) {
+    free_moment(base_moment);
+    free_order(order);
+    free(sweep);
+    free(align);
+    printf("error\n");
+    return -1;
+  }
+  for (int k = 0; k < count; ++ k) {
+    int const shift = k / brightness_count;
+    if (align != NULL) {
+      sweep[k].dx = align[shift].dx;
+      sweep[k].dy = align[shift].dy;
+    } else {
+      sweep[k].dx = -(shift % parts_size);
+      sweep[k].dy = -(shift / parts_size);
+    }
+    sweep[k].brightness = option->sweep ? option->sweep_min + k % brightness_count * option->sweep_step : align[shift].brightness;
+    sweep[k].mosaic = NULL;
+  }
+  free(align);
+
+  // 座標毎に独立して評価できるため並列化する
+  bool error = false;
+  #pragma omp parallel for schedule(dynamic)
+  for (int shift = 0; shift < shift_count; ++ shift) {
+    if (evaluate_sweep(option->solver, order, base_image, base_moment, target_image, &sweep[shift * brightness_count], brightness_count) < 0) {
+      #pragma omp atomic write
+      error = true;
+    }
+  }
+  free_moment(base_moment);
+  free_order(order);
+  if (error) {
+    for (int k = 0; k < count; ++ k) {
+      free_mosaic(sweep[k].mosaic);
+    }
+    free(sweep);
+    printf("error\n");
+    return -1;
+  }
+  printf("ok\n");
+
+  // 差異の総和が小さい順に上位をエクスポート
+  qsort(sweep, count, sizeof(sweep_t), compare_sweep);
+  int result = 0;
+  for (int k = 0; k < count && k < option->sweep_top; ++ k) {
+    sweep_t const* const s = &sweep[k];
+    char suffix[64];
+    char txt[FILE_NAME_SIZE];
+    char bmp[FILE_NAME_SIZE];
+    snprintf(suffix, sizeof(suffix), "_x%d_y%d_b%d", s->dx, s->dy, s->brightness);
+    create_file_name(txt, sizeof(txt), option->result_txt, suffix);
+    create_file_name(bmp, sizeof(bmp), option->result_bmp, suffix);
+    printf("rank %d [x:%d, y:%d, brightness:%d] ... %llu\n", k + 1, s->dx, s->dy, s->brightness, (unsigned long long)s->value);
+    printf("export txt [%s] ... ", txt);
+    if (export_mosaic_to_txt(txt, s->mosaic) < 0) {
+      printf("error\n");
+      result = -1;
+      break;
+    }
+    printf("ok\n");
+    printf("export bmp [%s] ... ", bmp);
+    if (export_mosaic_to_bmp(bmp, s->mosaic) < 0) {
+      printf("error\n");
+      result = -1;
+      break;
+    }
+    printf("ok\n");
+  }
+
+  for (int k = 0; k < count; ++ k) {
+    free_mosaic(sweep[k].mosaic);
+  }
+  free(sweep);
+  return result;
+}
+
+//////////////////////////////
+// ファイル名の拡張子の前に文字列を挿入
+//////////////////////////////
+void create_file_name(char* const dst, size_t const size, char const* const file_name, char const* const suffix) {
+  char const* const ext = strrchr(file_name, '.');
+  int const stem = (ext != NULL) ? (int)(ext - file_name) : (int)strlen(file_name);
+  snprintf(dst, size, "%.*s%s%s", stem, file_name, suffix, (ext != NULL) ? ext : "");
+}
+
+//////////////////////////////
+// 対象画像のファイル名から出力ファイル名を生成
+// 拡張子と "_parts" 以降を取り除いて suffix を付ける
+//////////////////////////////
+void create_result_name(char* const dst, size_t const size, char const* const target_file, char const* const suffix) {
+  char const* const ext = strrchr(target_file, '.');
+  char const* const parts = strstr(target_file, "_parts");
+  int stem = (ext != NULL) ? (int)(ext - target_file) : (int)strlen(target_file);
+  if (parts != NULL && parts - target_file < stem) {
+    stem = (int)(parts - target_file);
+  }
+  snprintf(dst, size, "%.*s%s", stem, target_file, suffix);
+}
+
+//////////////////////////////
+// 画像オブジェクトが全て使用されたかチェック
+//////////////////////////////
+bool check_image(image_t const* const image) {
+  for (int i = 0; i < image->size; ++ i) {
+    if (!image->locked[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+//////////////////////////////
+// モザイクに全てのパーツが使用されているかチェック
+//////////////////////////////
+bool check_mosaic(mosaic_t const* const mosaic) {
+  int const size = mosaic->height * mosaic->width;
+  bool* exist = (bool*)calloc(size, sizeof(bool));
+  if (exist == NULL) {
+    return false;
+  }
+  bool result = true;
+  for (int i = 0; i < size && result; ++ i) {
+    int const parts = mosaic->position[i].parts;
+    int const no = (parts >= 0 && parts < mosaic->image->size) ? mosaic->image->no[parts] : 0;
+    if (no < 1 || no > size) {
+      result = false;
+    } else {
+      exist[no - 1] = true;
+    }
+  }
+  for (int i = 0; i < size && result; ++ i) {
+    if (!exist[i]) {
+      result = false;
+    }
+  }
+  free(exist);
+  return result;
+}
+
+//////////////////////////////
+// 画像オブジェクトのメモリ確保
+//////////////////////////////
+image_t* alloc_image(int const height, int const width, int const parts_size, int const rotations, int const color) {
+  image_t* image = (image_t*)malloc(sizeof(image_t));
+  if (image == NULL) {
+    return NULL;
+  }
+  image->height = height;
+  image->width = width;
+  image->parts_size = parts_size;
+  image->size = height * width;
+  image->pixels = parts_size * parts_size;
+  image->rotations = rotations;
+  image->color = color;
+  image->channels = COLOR_CHANNELS[color];
+  image->ssd = select_ssd(image->pixels);
+  image->map = NULL;
+  image->map_size = 0;
+  image->no = (int*)malloc(sizeof(int) * image->size);
+  image->locked = (bool*)calloc(image->size, sizeof(bool));
+  image->brightness = (uint8_t*)malloc(sizeof(uint8_t) * image->size * rotations * image->channels * image->pixels);
+  if (image->no == NULL || image->locked == NULL || image->brightness == NULL) {
+    free_image(image);
+    return NULL;
+  }
+  return image;
+}
+
+//////////////////////////////
+// 画像オブジェクトの内容を複製(大きさと保持する回転数は同じであること)
+//////////////////////////////
+void copy_image(image_t* const dst, image_t const* const src) {
+  memcpy(dst->no, src->no, sizeof(int) * src->size);
+  memcpy(dst->locked, src->locked, sizeof(bool) * src->size);
+  memcpy(dst->brightness, src->brightness, sizeof(uint8_t) * src->size * src->rotations * src->channels * src->pixels);
+}
+
+//////////////////////////////
+// 画像オブジェクトの複製
+//////////////////////////////
+image_t* clone_image(image_t const* const image) {
+  image_t* clone = alloc_image(image->height, image->width, image->parts_size, image->rotations, image->color);
+  if (clone == NULL) {
+    return NULL;
+  }
+  copy_image(clone, image);
+  return clone;
+}
+
+//////////////////////////////
+// 画像オブジェクトの開放
+//////////////////////////////
+void free_image(image_t* const image) {
+  if (image == NULL) return;
+  if (image->map != NULL) {
+    munmap(image->map, image->map_size);
+  } else {
+    free(image->no);
+    free(image->brightness);
+  }
+  free(image->locked);
+  free(image);
+}
+
+//////////////////////////////
+// 90度回転した画像情報を生成(保持する回転のみ)
+//////////////////////////////
+void rotate_parts(image_t* const image, int const parts) {
+  int const parts_size = image->parts_size;
+  for (int r = 1; r < image->rotations; ++ r) {
+    for (int c = 0; c < image->channels; ++ c) {
+      uint8_t const* const src = get_brightness(image, parts, r - 1) + c * image->pixels;
+      uint8_t* const dst = get_brightness(image, parts, r) + c * image->pixels;
+      for (int py = 0; py < parts_size; ++ py) {
+        for (int px = 0; px < parts_size; ++ px) {
+          dst[(parts_size - px - 1) * parts_size + py] = src[py * parts_size + px];
+        }
+      }
+    }
+  }
+}
+
+//////////////////////////////
+// 空白を読み飛ばして整数を 1 つ読む(数値がなければ false)
+//////////////////////////////
+bool scan_int(char const** const cursor, char const* const end, int* const value) {
+  char const* p = *cursor;
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) ++ p;
+  bool const minus = (p < end && *p == '-');
+  if (minus) ++ p;
+  if (p >= end || (unsigned)(*p - '0') > 9) {
+    *cursor = p;
+    return false;
+  }
+  int result = 0;
+  for (; p < end && (unsigned)(*p - '0') <= 9; ++ p) {
+    if (result > 100000000) {
+      *cursor = p;
+      return false;
+    }
+    result = result * 10 + (*p - '0');
+  }
+  *cursor = p;
+  *value = minus ? -result : result;
+  return true;
+}
+
+//////////////////////////////
+// TXTから画像オブジェクトの生成
+// ファイルをメモリにマップして直接読み込む。
+// パーツの一辺は 2 行目の数値の個数から、パーツ数はファイル全体の数値の個数から求める。
+// width, height が 0 の場合は正方形に並んでいるとみなす。
+// パーツ番号は 1 からパーツ数まで重複なく、画素値は 0 から 255 であること
+//////////////////////////////
+image_t* create_image_by_txt(char const* const file_name, int const width, int const height, int const rotations) {
+  int const fd = open(file_name, O_RDONLY);
+  if (fd < 0) return NULL;
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+    close(fd);
+    return NULL;
+  }
+  size_t const length = (size_t)st.st_size;
+  void* const map = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return NULL;
+  char const* const begin = (char const*)map;
+  char const* const end = begin + length;
+
+  // パーツの一辺の画素数(最初のパーツ番号の次の行の数値の個数)
+  int parts_size = 0;
+  int value = 0;
+  char const* p = begin;
+  if (!scan_int(&p, end, &value)) {
+    munmap(map, length);
+    return NULL;
+  }
+  while (p < end && *p != '\n') ++ p;
+  if (p < end) ++ p;
+  char const* line_end = (char const*)memchr(p, '\n', end - p);
+  if (line_end == NULL) line_end = end;
+  while (scan_int(&p, line_end, &value)) ++ parts_size;
+
+  // パーツ数(パーツ毎に番号と画素の数値が並ぶ)
+  long count = 0;
+  for (p = begin; scan_int(&p, end, &value); ) ++ count;
+  int const size = (parts_size > 0) ? (int)(count / (1 + parts_size * parts_size)) : 0;
+  int image_width = width;
+  int image_height = height;
+  if (image_width <= 0 || image_height <= 0) {
+    image_width = (int)sqrt((double)size);
+    while (image_width * image_width < size) ++ image_width;
+    while (image_width * image_width > size) -- image_width;
+    image_height = image_width;
+  }
+  if (size <= 0 || image_width * image_height != size) {
+    munmap(map, length);
+    return NULL;
+  }
+
+  // メモリ確保
+  image_t* image = alloc_image(image_height, image_width, parts_size, rotations, COLOR_GRAY);
+  if (image == NULL) {
+    munmap(map, length);
+    return NULL;
+  }
 
-  fclose(fp);
+  // ファイル読み込み(使用済みフラグはパーツ番号の重複チェックに流用する)
+  p = begin;
+  bool error = false;
+  for (int i = 0; i < image->size && !error; ++ i) {
+    int no = 0;
+    if (!scan_int(&p, end, &no) || no < 1 || no > image->size || image->locked[no - 1]) {
+      error = true;
+      break;
+    }
+    image->no[i] = no;
+    image->locked[no - 1] = true;
+    uint8_t* const data = get_brightness(image, i, 0);
+    for (int k = 0; k < image->pixels; ++ k) {
+      int brightness = 0;
+      if (!scan_int(&p, end, &brightness) || brightness < 0 || brightness > 255) {
+        error = true;
+        break;
+      }
+      data[k] = (uint8_t)brightness;
+    }
+    rotate_parts(image, i);
+  }
+  munmap(map, length);
+  if (error) {
+    free_image(image);
+    return NULL;
+  }
+  memset(image->locked, 0, sizeof(bool) * image->size);
   return image;
 }
 
 //////////////////////////////
-// BMPから画像オブジェクトの生成
+// 画素オブジェクトの生成
+//////////////////////////////
+raster_t* alloc_raster(int const height, int const width, int const channels) {
+  raster_t* raster = (raster_t*)malloc(sizeof(raster_t));
+  if (raster == NULL) {
+    return NULL;
+  }
+  raster->height = height;
+  raster->width = width;
+  raster->channels = channels;
+  raster->pixel = (uint8_t*)malloc(sizeof(uint8_t) * channels * height * width);
+  if (raster->pixel == NULL) {
+    free(raster);
+    return NULL;
+  }
+  return raster;
+}
+
+//////////////////////////////
+// 画素オブジェクトの開放
+//////////////////////////////
+void free_raster(raster_t* const raster) {
+  if (raster == NULL) return;
+  free(raster->pixel);
+  free(raster);
+}
+
+//////////////////////////////
+// 画素値の読み込み(RGB をグレースケールに変換、ITU-R BT.601 の係数を 8bit の固定小数点で近似)
+//////////////////////////////
+uint8_t convert_gray(int const red, int const green, int const blue) {
+  return (uint8_t)((77 * red + 150 * green + 29 * blue + 128) >> 8);
+}
+
+//////////////////////////////
+// 画素値を 0 から 255 に丸める
+//////////////////////////////
+uint8_t clamp_color(int const value) {
+  return (uint8_t)((value < 0) ? 0 : (value > 255) ? 255 : value);
+}
+
+//////////////////////////////
+// RGB を色空間に変換して書き込む(dst から plane 毎に 1 色ずつ)
+// YCbCr は JPEG と同じ ITU-R BT.601 のフルレンジを 8bit の固定小数点で近似する
 //////////////////////////////
-image_t* create_image_by_bmp(char const* const file_name) {
+void encode_color(int const color, int const red, int const green, int const blue, uint8_t* const dst, size_t const plane) {
+  if (color == COLOR_GRAY) {
+    dst[0] = convert_gray(red, green, blue);
+  } else if (color == COLOR_RGB) {
+    dst[0] = (uint8_t)red;
+    dst[plane] = (uint8_t)green;
+    dst[plane * 2] = (uint8_t)blue;
+  } else {
+    dst[0] = convert_gray(red, green, blue);
+    dst[plane] = clamp_color(((-43 * red - 85 * green + 128 * blue + 128) >> 8) + 128);
+    dst[plane * 2] = clamp_color(((128 * red - 107 * green - 21 * blue + 128) >> 8) + 128);
+  }
+}
+
+//////////////////////////////
+// 色空間の画素値を RGB に戻す(src から plane 毎に 1 色ずつ)
+//////////////////////////////
+void decode_color(int const color, uint8_t const* const src, size_t const plane, int* const rgb) {
+  if (color == COLOR_GRAY) {
+    rgb[0] = rgb[1] = rgb[2] = src[0];
+  } else if (color == COLOR_RGB) {
+    rgb[0] = src[0];
+    rgb[1] = src[plane];
+    rgb[2] = src[plane * 2];
+  } else {
+    int const y = src[0];
+    int const cb = src[plane] - 128;
+    int const cr = src[plane * 2] - 128;
+    rgb[0] = clamp_color(y + ((359 * cr + 128) >> 8));
+    rgb[1] = clamp_color(y + ((-88 * cb - 183 * cr + 128) >> 8));
+    rgb[2] = clamp_color(y + ((454 * cb + 128) >> 8));
+  }
+}
+
+//////////////////////////////
+// BMP から画素オブジェクトを生成(8bit パレット・24bit、無圧縮のみ)
+// channels が 1 ならグレースケール、3 なら RGB の平面で保持する
+//////////////////////////////
+raster_t* create_raster_by_bmp(char const* const file_name, int const channels) {
   FILE* fp = fopen(file_name, "rb");
   if (fp == NULL) return NULL;
 
   int const bmp_file_header_size = 14;
   int const bmp_info_header_size = 40;
-  int const bmp_color = 256;
-  int const bmp_color_byte = 4;
   int const bmp_header_size = bmp_file_header_size + bmp_info_header_size;
-  int const bmp_color_size = bmp_color * bmp_color_byte;
-  int const height = IMAGE_HEIGHT * PARTS_HEIGHT;
-  int const width = IMAGE_WIDTH * PARTS_WIDTH;
-  int const width_align = width + (width % 4);
 
   // BMPヘッダー読み込み
   bmp_header_t header;
-  if (fread(&header, bmp_header_size, 1, fp) < 1) {
+  if (fread(&header, bmp_header_size, 1, fp) < 1 || header.type != 0x4D42 ||
+      header.info_size < (uint32_t)bmp_info_header_size || header.compression != 0 ||
+      (header.bit != 8 && header.bit != 24) || header.width <= 0 || header.height == 0) {
     fclose(fp);
     return NULL;
   }
+  // 高さが負の場合は上の行から並んでいる
+  bool const top_down = (header.height < 0);
+  int const height = top_down ? -header.height : header.height;
+  int const width = header.width;
+  size_t const stride = ((size_t)width * (header.bit / 8) + 3) & ~(size_t)3;
 
-  // 画像領域まで移動
-  if (fseek(fp, header.offset, SEEK_SET) != 0) {
-    fclose(fp);
-    return NULL;
+  // カラーパレット読み込み
+  bmp_color_t palette[256];
+  for (int i = 0; i < 256; ++ i) {
+    palette[i].blue = palette[i].green = palette[i].red = (uint8_t)i;
+    palette[i].reserved = 0;
   }
-
-  // バッファ生成
-  uint8_t* buffer = (uint8_t*)malloc(header.image_size);
-  if (buffer == NULL) {
-    fclose(fp);
-    return NULL;
+  if (header.bit == 8) {
+    int const count = (header.color_used > 0 && header.color_used <= 256) ? (int)header.color_used : 256;
+    if (fseek(fp, bmp_file_header_size + header.info_size, SEEK_SET) != 0 ||
+        fread(palette, sizeof(bmp_color_t), count, fp) < (size_t)count) {
+      fclose(fp);
+      return NULL;
+    }
   }
 
   // 画像領域読み込み
-  if (fread(buffer, header.image_size, 1, fp) < 1) {
+  uint8_t* buffer = (uint8_t*)malloc(stride * height);
+  raster_t* raster = alloc_raster(height, width, channels);
+  if (buffer == NULL || raster == NULL ||
+      fseek(fp, header.offset, SEEK_SET) != 0 || fread(buffer, stride * height, 1, fp) < 1) {
+    free_raster(raster);
     free(buffer);
     fclose(fp);
     return NULL;
   }
   fclose(fp);
 
-  // メモリ確保
-  image_t* image = (image_t*)malloc(sizeof(image_t));
+  size_t const plane = (size_t)height * width;
+  int const color = (channels == 1) ? COLOR_GRAY : COLOR_RGB;
+  for (int y = 0; y < height; ++ y) {
+    uint8_t const* const src = &buffer[(top_down ? y : height - y - 1) * stride];
+    uint8_t* const dst = &raster->pixel[(size_t)y * width];
+    for (int x = 0; x < width; ++ x) {
+      if (header.bit == 8) {
+        bmp_color_t const* const c = &palette[src[x]];
+        encode_color(color, c->red, c->green, c->blue, &dst[x], plane);
+      } else {
+        encode_color(color, src[x * 3 + 2], src[x * 3 + 1], src[x * 3], &dst[x], plane);
+      }
+    }
+  }
+
+  free(buffer);
+  return raster;
+}
+
+//////////////////////////////
+// PGM のヘッダーの数値の読み込み(空白と # から行末までのコメントを読み飛ばす)
+//////////////////////////////
+bool scan_pgm_int(char const** const cursor, char const* const end, int* const value) {
+  char const* p = *cursor;
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n' || *p == '#')) {
+    if (*p == '#') {
+      while (p < end && *p != '\n') ++ p;
+    } else {
+      ++ p;
+    }
+  }
+  *cursor = p;
+  return scan_int(cursor, end, value);
+}
+
+//////////////////////////////
+// PGM から画素オブジェクトを生成(P2: テキスト, P5: バイナリ、最大値が 255 を超える場合は 16bit)
+// channels が 3 なら同じ値を RGB の各平面に複製する
+//////////////////////////////
+raster_t* create_raster_by_pgm(char const* const file_name, int const channels) {
+  int fd = open(file_name, O_RDONLY);
+  if (fd < 0) return NULL;
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size < 2) {
+    close(fd);
+    return NULL;
+  }
+  size_t const map_size = (size_t)st.st_size;
+  void* map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return NULL;
+
+  char const* const begin = (char const*)map;
+  char const* const end = begin + map_size;
+  char const* cursor = begin + 2;
+  int width = 0;
+  int height = 0;
+  int max = 0;
+  bool const binary = (begin[0] == 'P' && begin[1] == '5');
+  if (begin[0] != 'P' || (begin[1] != '2' && begin[1] != '5') ||
+      !scan_pgm_int(&cursor, end, &width) || !scan_pgm_int(&cursor, end, &height) || !scan_pgm_int(&cursor, end, &max) ||
+      width <= 0 || height <= 0 || max <= 0 || max > 65535) {
+    munmap(map, map_size);
+    return NULL;
+  }
+  raster_t* raster = alloc_raster(height, width, channels);
+  if (raster == NULL) {
+    munmap(map, map_size);
+    return NULL;
+  }
+
+  // 最大値を 255 に合わせる
+  size_t const count = (size_t)width * height;
+  int const bytes = (max > 255) ? 2 : 1;
+  if (binary) {
+    // 最大値の後の空白 1 文字の次から画素値が並ぶ
+    ++ cursor;
+    if (cursor + count * bytes > end) {
+      free_raster(raster);
+      munmap(map, map_size);
+      return NULL;
+    }
+    uint8_t const* const data = (uint8_t const*)cursor;
+    for (size_t i = 0; i < count; ++ i) {
+      int const value = (bytes == 2) ? (data[i * 2] << 8 | data[i * 2 + 1]) : data[i];
+      raster->pixel[i] = (uint8_t)(((value < max ? value : max) * 255 + max / 2) / max);
+    }
+  } else {
+    for (size_t i = 0; i < count; ++ i) {
+      int value = 0;
+      if (!scan_int(&cursor, end, &value) || value < 0) {
+        free_raster(raster);
+        munmap(map, map_size);
+        return NULL;
+      }
+      raster->pixel[i] = (uint8_t)(((value < max ? value : max) * 255 + max / 2) / max);
+    }
+  }
+  for (int c = 1; c < channels; ++ c) {
+    memcpy(&raster->pixel[c * count], raster->pixel, count);
+  }
+
+  munmap(map, map_size);
+  return raster;
+}
+
+//////////////////////////////
+// 画素オブジェクトをパーツに分割して画像オブジェクトを生成
+// 横 width x 縦 height パーツ(0 なら画素数をパーツの一辺で割った数)の大きさに面積平均で拡大縮小する。
+// 出力の画素が覆う入力の画素を、重なる面積を重みとして平均する。パーツの 1 行分を帯として並列に処理する。
+// 色は RGB のまま拡大縮小してから color の色空間に変換する
+//////////////////////////////
+image_t* create_image_by_raster(raster_t const* const raster, int const width, int const height, int const parts_size, int const rotations, int const color) {
+  int const image_width = (width > 0) ? width : raster->width / parts_size;
+  int const image_height = (height > 0) ? height : raster->height / parts_size;
+  if (image_width <= 0 || image_height <= 0 || raster->channels != COLOR_CHANNELS[color]) {
+    return NULL;
+  }
+  image_t* image = alloc_image(image_height, image_width, parts_size, rotations, color);
   if (image == NULL) {
-    free(buffer);
-    fclose(fp);
     return NULL;
   }
 
-  // 画像情報の生成
-  for (int iy = 0; iy < IMAGE_HEIGHT; ++ iy) {
-    for (int ix = 0; ix < IMAGE_WIDTH; ++ ix) {
-      parts_t * const parts = &(image->parts[iy][ix]);
-      parts->locked = false;
-      parts->no = iy * IMAGE_WIDTH + ix + 1;
-      for (int py = 0; py < PARTS_HEIGHT; ++ py) {
-        for (int px = 0; px < PARTS_WIDTH; ++ px) {
-          int const idx = (IMAGE_HEIGHT - iy - 1) * width_align * PARTS_HEIGHT +
-                          (PARTS_HEIGHT - py - 1) * width_align + ix * PARTS_WIDTH + px;
-          int const brightness = buffer[idx];
-          parts->brightness[0][py][px] = (uint8_t)brightness;
+  int const dst_width = image_width * parts_size;
+  int const dst_height = image_height * parts_size;
+  double const scale_x = (double)raster->width / dst_width;
+  double const scale_y = (double)raster->height / dst_height;
+  double const area = scale_x * scale_y;
+  size_t const plane = (size_t)raster->height * raster->width;
+  int const pixels = image->pixels;
+  int failed = 0;
+
+  #pragma omp parallel for schedule(dynamic)
+  for (int iy = 0; iy < image_height; ++ iy) {
+    // 縦方向に平均した 1 行分(入力の幅)
+    double* row = (double*)malloc(sizeof(double) * raster->width);
+    if (row == NULL) {
+      #pragma omp atomic write
+      failed = 1;
+      continue;
+    }
+    for (int c = 0; c < raster->channels; ++ c) {
+      for (int py = 0; py < parts_size; ++ py) {
+        int const y = iy * parts_size + py;
+        double const y0 = y * scale_y;
+        double const y1 = (y + 1) * scale_y;
+        int const sy_end = ((int)ceil(y1) < raster->height) ? (int)ceil(y1) : raster->height;
+        memset(row, 0, sizeof(double) * raster->width);
+        for (int sy = (int)y0; sy < sy_end; ++ sy) {
+          double const weight = ((sy + 1 < y1) ? sy + 1 : y1) - ((sy > y0) ? sy : y0);
+          uint8_t const* const src = &raster->pixel[c * plane + (size_t)sy * raster->width];
+          for (int sx = 0; sx < raster->width; ++ sx) {
+            row[sx] += weight * src[sx];
+          }
         }
-      }
-      // 90度回転した画像情報を生成
-      for (int r = 1; r < ROTATION_SIZE; ++ r) {
-        for (int py = 0; py < PARTS_HEIGHT; ++ py) {
-          for (int px = 0; px < PARTS_WIDTH; ++ px) {
-            parts->brightness[r][PARTS_HEIGHT - px - 1][py] = parts->brightness[r - 1][py][px];
+        for (int x = 0; x < dst_width; ++ x) {
+          double const x0 = x * scale_x;
+          double const x1 = (x + 1) * scale_x;
+          int const sx_end = ((int)ceil(x1) < raster->width) ? (int)ceil(x1) : raster->width;
+          double sum = 0.0;
+          for (int sx = (int)x0; sx < sx_end; ++ sx) {
+            double const weight = ((sx + 1 < x1) ? sx + 1 : x1) - ((sx > x0) ? sx : x0);
+            sum += weight * row[sx];
           }
+          uint8_t* const data = get_brightness(image, iy * image_width + x / parts_size, 0);
+          data[c * pixels + py * parts_size + x % parts_size] = clamp_color((int)(sum / area + 0.5));
+        }
+      }
+    }
+    free(row);
+    for (int ix = 0; ix < image_width; ++ ix) {
+      int const i = iy * image_width + ix;
+      if (color == COLOR_YCBCR) {
+        uint8_t* const data = get_brightness(image, i, 0);
+        for (int p = 0; p < pixels; ++ p) {
+          encode_color(color, data[p], data[pixels + p], data[pixels * 2 + p], &data[p], pixels);
         }
       }
+      image->no[i] = i + 1;
+      rotate_parts(image, i);
     }
   }
 
-  free(buffer);
+  if (failed) {
+    free_image(image);
+    return NULL;
+  }
+  return image;
+}
+
+//////////////////////////////
+// BMPから画像オブジェクトの生成
+// 任意の大きさの 8bit・24bit の BMP を color の色空間に変換し、パーツに分割する
+//////////////////////////////
+image_t* create_image_by_bmp(char const* const file_name, int const width, int const height, int const parts_size, int const rotations, int const color) {
+  raster_t* raster = create_raster_by_bmp(file_name, COLOR_CHANNELS[color]);
+  if (raster == NULL) return NULL;
+  image_t* image = create_image_by_raster(raster, width, height, parts_size, rotations, color);
+  free_raster(raster);
+  return image;
+}
+
+//////////////////////////////
+// PGMから画像オブジェクトの生成
+//////////////////////////////
+image_t* create_image_by_pgm(char const* const file_name, int const width, int const height, int const parts_size, int const rotations, int const color) {
+  raster_t* raster = create_raster_by_pgm(file_name, COLOR_CHANNELS[color]);
+  if (raster == NULL) return NULL;
+  image_t* image = create_image_by_raster(raster, width, height, parts_size, rotations, color);
+  free_raster(raster);
+  return image;
+}
+
+//////////////////////////////
+// 画像オブジェクトを別の色空間に変換した画像オブジェクトの生成
+// (グレースケールから変換した場合は無彩色になる)
+//////////////////////////////
+image_t* convert_image(image_t const* const image, int const color) {
+  image_t* converted = alloc_image(image->height, image->width, image->parts_size, image->rotations, color);
+  if (converted == NULL) {
+    return NULL;
+  }
+  int const pixels = image->pixels;
+  for (int i = 0; i < image->size; ++ i) {
+    uint8_t const* const src = get_brightness(image, i, 0);
+    uint8_t* const dst = get_brightness(converted, i, 0);
+    for (int p = 0; p < pixels; ++ p) {
+      int rgb[CHANNEL_SIZE];
+      decode_color(image->color, &src[p], pixels, rgb);
+      encode_color(color, rgb[0], rgb[1], rgb[2], &dst[p], pixels);
+    }
+    converted->no[i] = image->no[i];
+    rotate_parts(converted, i);
+  }
+  return converted;
+}
+
+//////////////////////////////
+// バイナリ形式から画像オブジェクトの生成
+// ファイルを書き込み時コピーでマップし、パーツ番号と輝度はマップした領域をそのまま使う
+// (輝度を変更するまでは複数のプロセスでページを共有できる)。
+// ファイルの回転数が rotations に足りない場合のみヒープに展開する
+//////////////////////////////
+image_t* create_image_by_bin(char const* const file_name, int const rotations) {
+  int const fd = open(file_name, O_RDONLY);
+  if (fd < 0) return NULL;
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(tile_header_t)) {
+    close(fd);
+    return NULL;
+  }
+  size_t const length = (size_t)st.st_size;
+  void* const map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return NULL;
+
+  // ヘッダーの検証
+  tile_header_t const* const header = (tile_header_t const*)map;
+  size_t const size = (size_t)header->height * header->width;
+  size_t const pixels = (size_t)header->parts_size * header->parts_size;
+  int const color = (header->no_offset >= sizeof(tile_header_t)) ? header->color : COLOR_GRAY;
+  if (header->magic != TILE_MAGIC || (header->rotation != 1 && header->rotation != ROTATION_SIZE) ||
+      color < COLOR_GRAY || color > COLOR_YCBCR ||
+      header->height <= 0 || header->width <= 0 || header->parts_size <= 0 ||
+      header->no_offset % sizeof(int) != 0 || header->brightness_offset % TILE_ALIGN != 0 ||
+      header->no_offset + sizeof(int) * size > length ||
+      header->brightness_offset + size * header->rotation * COLOR_CHANNELS[color] * pixels > length) {
+    munmap(map, length);
+    return NULL;
+  }
+
+  // メモリ確保(使用済みフラグのみ)
+  image_t* image = (image_t*)malloc(sizeof(image_t));
+  if (image == NULL) {
+    munmap(map, length);
+    return NULL;
+  }
+  image->height = header->height;
+  image->width = header->width;
+  image->parts_size = header->parts_size;
+  image->size = (int)size;
+  image->pixels = (int)pixels;
+  image->rotations = header->rotation;
+  image->color = color;
+  image->channels = COLOR_CHANNELS[color];
+  image->ssd = select_ssd(image->pixels);
+  image->no = (int*)((uint8_t*)map + header->no_offset);
+  image->brightness = (uint8_t*)map + header->brightness_offset;
+  image->map = map;
+  image->map_size = length;
+  image->locked = (bool*)calloc(size, sizeof(bool));
+  if (image->locked == NULL) {
+    free_image(image);
+    return NULL;
+  }
+
+  // パーツ番号の検証(使用済みフラグを重複チェックに流用する)
+  for (int i = 0; i < image->size; ++ i) {
+    int const no = image->no[i];
+    if (no < 1 || no > image->size || image->locked[no - 1]) {
+      free_image(image);
+      return NULL;
+    }
+    image->locked[no - 1] = true;
+  }
+  memset(image->locked, 0, sizeof(bool) * image->size);
+
+  // 回転を生成する
+  if (image->rotations < rotations) {
+    image_t* expanded = alloc_image(image->height, image->width, image->parts_size, rotations, image->color);
+    for (int i = 0; expanded != NULL && i < image->size; ++ i) {
+      expanded->no[i] = image->no[i];
+      memcpy(get_brightness(expanded, i, 0), get_brightness(image, i, 0), sizeof(uint8_t) * image->channels * image->pixels);
+      rotate_parts(expanded, i);
+    }
+    free_image(image);
+    return expanded;
+  }
+  return image;
+}
+
+//////////////////////////////
+// ファイルの形式に合わせて画像オブジェクトの生成
+// 拡張子が .bin ならバイナリ形式、.bmp なら BMP、.pgm なら PGM、それ以外は TXT とみなす。
+// TXT(グレースケールのみ)とバイナリ形式は保存した色空間で読み込み、color と異なれば変換する
+//////////////////////////////
+image_t* create_image_by_file(char const* const file_name, int const width, int const height, int const parts_size, int const rotations, int const color) {
+  char const* const ext = strrchr(file_name, '.');
+  if (ext != NULL && strcmp(ext, ".bmp") == 0) {
+    return create_image_by_bmp(file_name, width, height, parts_size, rotations, color);
+  }
+  if (ext != NULL && strcmp(ext, ".pgm") == 0) {
+    return create_image_by_pgm(file_name, width, height, parts_size, rotations, color);
+  }
+  image_t* image = (ext != NULL && strcmp(ext, ".bin") == 0) ?
+    create_image_by_bin(file_name, rotations) : create_image_by_txt(file_name, width, height, rotations);
+  if (image != NULL && image->color != color) {
+    image_t* converted = convert_image(image, color);
+    free_image(image);
+    return converted;
+  }
   return image;
 }
 
@@ -595,14 +4817,20 @@ mosaic_t* create_mosaic_by_image(image_t const* const image) {
   if (mosaic == NULL) {
     return NULL;
   }
+  mosaic->height = image->height;
+  mosaic->width = image->width;
+  mosaic->image = image;
+  mosaic->position = (position_t*)malloc(sizeof(position_t) * image->size);
+  if (mosaic->position == NULL) {
+    free(mosaic);
+    return NULL;
+  }
 
   // パーツ関連付け
-  for (int iy = 0; iy < IMAGE_HEIGHT; ++ iy) {
-    for (int ix = 0; ix < IMAGE_WIDTH; ++ ix) {
-      position_t* const position = &(mosaic->position[iy][ix]);
-      position->rotation = 0;
-      position->parts = &(image->parts[iy][ix]);
-    }
+  for (int i = 0; i < image->size; ++ i) {
+    position_t* const position = &(mosaic->position[i]);
+    position->rotation = 0;
+    position->parts = i;
   }
 
   return mosaic;
@@ -616,31 +4844,37 @@ mosaic_t* create_mosaic_by_txt(char const* const file_name, image_t const* const
   if (fp == NULL) return NULL;
 
   // メモリ確保
-  mosaic_t* mosaic = (mosaic_t*)malloc(sizeof(mosaic_t));
+  mosaic_t* mosaic = create_mosaic_by_image(image);
   if (mosaic == NULL) {
+    fclose(fp);
     return NULL;
   }
 
   // ファイル読み込み
-  for (int iy = 0; iy < IMAGE_HEIGHT; ++ iy) {
-    for (int ix = 0; ix < IMAGE_WIDTH; ++ ix) {
-      position_t* const position = &(mosaic->position[iy][ix]);
-      int no;
-      if (fscanf(fp, "%d %d", &no, &(position->rotation)) == EOF) {
-        free(mosaic);
-        fclose(fp);
-        return NULL;
-      }
-      int const py = (no - 1) / IMAGE_WIDTH;
-      int const px = (no - 1) % IMAGE_WIDTH;
-      position->parts = &(image->parts[py][px]);
+  for (int i = 0; i < image->size; ++ i) {
+    position_t* const position = &(mosaic->position[i]);
+    int no;
+    if (fscanf(fp, "%d %d", &no, &(position->rotation)) != 2 || no < 1 || no > image->size) {
+      free_mosaic(mosaic);
+      fclose(fp);
+      return NULL;
     }
+    position->parts = no - 1;
   }
 
   fclose(fp);
   return mosaic;
 }
 
+//////////////////////////////
+// モザイクオブジェクトの開放
+//////////////////////////////
+void free_mosaic(mosaic_t* const mosaic) {
+  if (mosaic == NULL) return;
+  free(mosaic->position);
+  free(mosaic);
+}
+
 //////////////////////////////
 // モザイクオブジェクトをTXTにエクスポート
 //////////////////////////////
@@ -648,13 +4882,11 @@ int export_mosaic_to_txt(char const* const file_name, mosaic_t const* const mosa
   FILE* fp = fopen(file_name, "w");
   if (fp == NULL) return -1;
 
-  for (int iy = 0; iy < IMAGE_HEIGHT; ++ iy) {
-    for (int ix = 0; ix < IMAGE_WIDTH; ++ ix) {
-      position_t const* const position = &(mosaic->position[iy][ix]);
-      if (fprintf(fp, "%d %d\n", position->parts->no, position->rotation) < 0) {
-        fclose(fp);
-        return -1;
-      }
+  for (int i = 0; i < mosaic->height * mosaic->width; ++ i) {
+    position_t const* const position = &(mosaic->position[i]);
+    if (fprintf(fp, "%d %d\n", mosaic->image->no[position->parts], position->rotation) < 0) {
+      fclose(fp);
+      return -1;
     }
   }
 
@@ -663,21 +4895,18 @@ int export_mosaic_to_txt(char const* const file_name, mosaic_t const* const mosa
 }
 
 //////////////////////////////
-// モザイクオブジェクトをBMPにエクスポート
+// BMPヘッダーとカラーパレット(256 階調のグレースケール)の書き込み
+// channels が 3 なら 24bit とし、カラーパレットは書き込まない
 //////////////////////////////
-int export_mosaic_to_bmp(char const* const file_name, mosaic_t const* const mosaic) {
-  FILE* fp = fopen(file_name, "wb");
-  if (fp == NULL) return -1;
-
+int write_bmp_header(FILE* const fp, int const width, int const height, int const channels) {
   int const bmp_file_header_size = 14;
   int const bmp_info_header_size = 40;
   int const bmp_color = 256;
   int const bmp_color_byte = 4;
   int const bmp_header_size = bmp_file_header_size + bmp_info_header_size;
-  int const bmp_color_size = bmp_color * bmp_color_byte;
-  int const height = IMAGE_HEIGHT * PARTS_HEIGHT;
-  int const width = IMAGE_WIDTH * PARTS_WIDTH;
-  int const width_align = width + (width % 4);
+  int const bmp_color_size = (channels == 1) ? bmp_color * bmp_color_byte : 0;
+  // 1 行は 4 バイト境界に揃える
+  uint32_t const width_align = ((uint32_t)width * channels + 3) & ~3u;
 
   // BMPヘッダー書き込み
   bmp_header_t header;
@@ -690,7 +4919,7 @@ int export_mosaic_to_bmp(char const* const file_name, mosaic_t const* const mosa
   header.width = width;
   header.height = height;
   header.plane = 1;
-  header.bit = 8;
+  header.bit = 8 * channels;
   header.compression = 0;
   header.image_size = height * width_align;
   header.ppm_x = 0;
@@ -699,9 +4928,11 @@ int export_mosaic_to_bmp(char const* const file_name, mosaic_t const* const mosa
   header.color_important = 0;
 
   if (fwrite(&header, bmp_header_size, 1, fp) < 1) {
-    fclose(fp);
     return -1;
   }
+  if (channels != 1) {
+    return 0;
+  }
 
   // カラーパレット書き込み
   bmp_color_t color[bmp_color];
@@ -714,27 +4945,73 @@ int export_mosaic_to_bmp(char const* const file_name, mosaic_t const* const mosa
   }
 
   if (fwrite(color, bmp_color_size, 1, fp) < 1) {
-    fclose(fp);
+    return -1;
+  }
+  return 0;
+}
+
+//////////////////////////////
+// パーツを並べた画像を BMP の画像領域として書き込み
+// BMP は下の行から並べるため、パーツの行を下から 1 段ずつ帯状のバッファに展開して書き込む
+// (バッファは 1 段分のみで、出力の大きさによらない)。position が NULL なら並び順のまま回転 0 で書き込む。
+// カラーは RGB に戻して BGR の順に並べる
+//////////////////////////////
+int write_bmp_band(FILE* const fp, image_t const* const image, position_t const* const position, int const height, int const width) {
+  int const parts_size = image->parts_size;
+  int const channels = image->channels;
+  size_t const width_align = ((size_t)width * parts_size * channels + 3) & ~(size_t)3;
+  // 端数の画素は 0 のまま残す
+  uint8_t* band = (uint8_t*)calloc(width_align * parts_size, sizeof(uint8_t));
+  uint8_t* rotated = (uint8_t*)malloc(sizeof(uint8_t) * channels * image->pixels);
+  if (band == NULL || rotated == NULL) {
+    free(rotated);
+    free(band);
     return -1;
   }
 
-  // 画像領域書き込み
-  int const buffer_size = height * width_align;
-  uint8_t buffer[buffer_size];
-  for (int iy = 0; iy < IMAGE_HEIGHT; ++ iy) {
-    for (int ix = 0; ix < IMAGE_WIDTH; ++ ix) {
-      position_t const* const position = &(mosaic->position[iy][ix]);
-      for (int py = 0; py < PARTS_HEIGHT; ++ py) {
-        for (int px = 0; px < PARTS_WIDTH; ++ px) {
-          int const idx = (IMAGE_HEIGHT - iy - 1) * width_align * PARTS_HEIGHT +
-                          (PARTS_HEIGHT - py - 1) * width_align + ix * PARTS_WIDTH + px;
-          buffer[idx] = position->parts->brightness[position->rotation][py][px];
+  for (int iy = height - 1; iy >= 0; -- iy) {
+    for (int ix = 0; ix < width; ++ ix) {
+      int const i = iy * width + ix;
+      uint8_t const* const data = (position != NULL) ?
+        get_rotated_brightness(image, position[i].parts, position[i].rotation, rotated) :
+        get_brightness(image, i, 0);
+      for (int py = 0; py < parts_size; ++ py) {
+        uint8_t* const line = &band[(parts_size - py - 1) * width_align + (size_t)ix * parts_size * channels];
+        if (channels == 1) {
+          memcpy(line, &data[py * parts_size], parts_size);
+          continue;
+        }
+        for (int px = 0; px < parts_size; ++ px) {
+          int rgb[CHANNEL_SIZE];
+          decode_color(image->color, &data[py * parts_size + px], image->pixels, rgb);
+          line[px * 3] = (uint8_t)rgb[2];
+          line[px * 3 + 1] = (uint8_t)rgb[1];
+          line[px * 3 + 2] = (uint8_t)rgb[0];
         }
       }
     }
+    if (fwrite(band, width_align * parts_size, 1, fp) < 1) {
+      free(rotated);
+      free(band);
+      return -1;
+    }
   }
 
-  if (fwrite(buffer, buffer_size, 1, fp) < 1) {
+  free(rotated);
+  free(band);
+  return 0;
+}
+
+//////////////////////////////
+// モザイクオブジェクトをBMPにエクスポート
+//////////////////////////////
+int export_mosaic_to_bmp(char const* const file_name, mosaic_t const* const mosaic) {
+  FILE* fp = fopen(file_name, "wb");
+  if (fp == NULL) return -1;
+
+  int const parts_size = mosaic->image->parts_size;
+  if (write_bmp_header(fp, mosaic->width * parts_size, mosaic->height * parts_size, mosaic->image->channels) < 0 ||
+      write_bmp_band(fp, mosaic->image, mosaic->position, mosaic->height, mosaic->width) < 0) {
     fclose(fp);
     return -1;
   }
@@ -751,29 +5028,28 @@ int export_image_to_txt(char const* const file_name, image_t const* const image)
   if (fp == NULL) return -1;
 
   // ファイル書き込み
-  for (int iy = 0; iy < IMAGE_HEIGHT; ++ iy) {
-    for (int ix = 0; ix < IMAGE_WIDTH; ++ ix) {
-      parts_t const* const parts = &(image->parts[iy][ix]);
-      if (fprintf(fp, "%d\n", parts->no) < 0) {
+  int const parts_size = image->parts_size;
+  for (int i = 0; i < image->size; ++ i) {
+    uint8_t const* const data = get_brightness(image, i, 0);
+    if (fprintf(fp, "%d\n", image->no[i]) < 0) {
+      fclose(fp);
+      return -1;
+    }
+    for (int py = 0; py < parts_size; ++ py) {
+      if (fprintf(fp, "%d", data[py * parts_size]) < 0) {
         fclose(fp);
         return -1;
       }
-      for (int py = 0; py < PARTS_HEIGHT; ++ py) {
-        if (fprintf(fp, "%d", parts->brightness[0][py][0]) < 0) {
-          fclose(fp);
-          return -1;
-        }
-        for (int px = 1; px < PARTS_WIDTH; ++ px) {
-          if (fprintf(fp, " %d", parts->brightness[0][py][px]) < 0) {
-            fclose(fp);
-            return -1;
-          }
-        }
-        if (fprintf(fp, "\n") < 0) {
+      for (int px = 1; px < parts_size; ++ px) {
+        if (fprintf(fp, " %d", data[py * parts_size + px]) < 0) {
           fclose(fp);
           return -1;
         }
       }
+      if (fprintf(fp, "\n") < 0) {
+        fclose(fp);
+        return -1;
+      }
     }
   }
 
@@ -788,76 +5064,48 @@ int export_image_to_bmp(char const* const file_name, image_t const* const image)
   FILE* fp = fopen(file_name, "wb");
   if (fp == NULL) return -1;
 
-  int const bmp_file_header_size = 14;
-  int const bmp_info_header_size = 40;
-  int const bmp_color = 256;
-  int const bmp_color_byte = 4;
-  int const bmp_header_size = bmp_file_header_size + bmp_info_header_size;
-  int const bmp_color_size = bmp_color * bmp_color_byte;
-  int const height = IMAGE_HEIGHT * PARTS_HEIGHT;
-  int const width = IMAGE_WIDTH * PARTS_WIDTH;
-  int const width_align = width + (width % 4);
-
-  // BMPヘッダー書き込み
-  bmp_header_t header;
-  header.type = 0x4D42;
-  header.file_size = bmp_header_size + bmp_color_size + height * width_align;
-  header.reserved1 = 0;
-  header.reserved2 = 0;
-  header.offset = bmp_header_size + bmp_color_size;
-  header.info_size = bmp_info_header_size;
-  header.width = width;
-  header.height = height;
-  header.plane = 1;
-  header.bit = 8;
-  header.compression = 0;
-  header.image_size = height * width_align;
-  header.ppm_x = 0;
-  header.ppm_y = 0;
-  header.color_used = 0;
-  header.color_important = 0;
-
-  if (fwrite(&header, bmp_header_size, 1, fp) < 1) {
+  int const parts_size = image->parts_size;
+  if (write_bmp_header(fp, image->width * parts_size, image->height * parts_size, image->channels) < 0 ||
+      write_bmp_band(fp, image, NULL, image->height, image->width) < 0) {
     fclose(fp);
     return -1;
   }
 
-  // カラーパレット書き込み
-  bmp_color_t color[bmp_color];
-  for (int i = 0; i < bmp_color; ++ i) {
-    bmp_color_t* const ci = &(color[i]);
-    ci->blue = i;
-    ci->green = i;
-    ci->red = i;
-    ci->reserved = 0;
-  }
+  fclose(fp);
+  return 0;
+}
 
-  if (fwrite(color, bmp_color_size, 1, fp) < 1) {
-    fclose(fp);
-    return -1;
-  }
+//////////////////////////////
+// 画像オブジェクトをバイナリ形式にエクスポート
+// ヘッダー、パーツ番号、輝度(保持している回転、64 バイト境界から連続)の順に書き込む
+//////////////////////////////
+int export_image_to_bin(char const* const file_name, image_t const* const image) {
+  FILE* fp = fopen(file_name, "wb");
+  if (fp == NULL) return -1;
 
-  // 画像領域書き込み
-  int const buffer_size = height * width_align;
-  uint8_t buffer[buffer_size];
-  for (int iy = 0; iy < IMAGE_HEIGHT; ++ iy) {
-    for (int ix = 0; ix < IMAGE_WIDTH; ++ ix) {
-      parts_t const* const parts = &(image->parts[iy][ix]);
-      for (int py = 0; py < PARTS_HEIGHT; ++ py) {
-        for (int px = 0; px < PARTS_WIDTH; ++ px) {
-          int const idx = (IMAGE_HEIGHT - iy - 1) * width_align * PARTS_HEIGHT +
-                          (PARTS_HEIGHT - py - 1) * width_align + ix * PARTS_WIDTH + px;
-          buffer[idx] = parts->brightness[0][py][px];
-        }
-      }
-    }
-  }
+  size_t const no_size = sizeof(int) * image->size;
+  tile_header_t header;
+  header.magic = TILE_MAGIC;
+  header.height = image->height;
+  header.width = image->width;
+  header.parts_size = image->parts_size;
+  header.rotation = image->rotations;
+  header.no_offset = sizeof(tile_header_t);
+  header.brightness_offset = (sizeof(tile_header_t) + no_size + TILE_ALIGN - 1) / TILE_ALIGN * TILE_ALIGN;
+  header.color = image->color;
+  header.reserved = 0;
 
-  if (fwrite(buffer, buffer_size, 1, fp) < 1) {
+  uint8_t padding[TILE_ALIGN] = { 0 };
+  size_t const padding_size = header.brightness_offset - sizeof(tile_header_t) - no_size;
+  size_t const count = (size_t)image->size * image->rotations * image->channels * image->pixels;
+  if (fwrite(&header, sizeof(header), 1, fp) < 1 ||
+      fwrite(image->no, sizeof(int), image->size, fp) < (size_t)image->size ||
+      fwrite(padding, 1, padding_size, fp) < padding_size ||
+      fwrite(image->brightness, sizeof(uint8_t), count, fp) < count) {
     fclose(fp);
     return -1;
   }
 
   fclose(fp);
   return 0;
-}
\ No newline at end of file
+}